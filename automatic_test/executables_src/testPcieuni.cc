@@ -7,8 +7,14 @@ using namespace boost::unit_test_framework;
 
 #include <boost/shared_ptr.hpp>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <vector>
+
 // we use the defines from the original implementation
 #include <gpcieuni/pcieuni_io.h>
+#include "pcieuni_drv_io.h"
 
 #define PCIEUNI_NAME "pcieuni"
 #define PCIEUNI_SLOT "s6"
@@ -24,6 +30,8 @@ using namespace boost::unit_test_framework;
 #define WORD_TIMING_TRG_SEL 0x80 // bar 1
 #define WORD_DAQ_ENABLE 0x08     // bar 1
 
+#define DMA_TEST_SIZE 4096 // one page, fits into every DMA buffer
+
 #define MIKRS(tv) (((double)(tv).tv_usec) + ((double)(tv).tv_sec * 1000000.0))
 
 class PcieuniTest {
@@ -33,6 +41,7 @@ class PcieuniTest {
   void testUserFunctions();
   void testIoctl();
   void testReadWrite();
+  void testRegisterBatch();
 
  private:
   boost::shared_ptr<ReaderWriter> _readerWriter;
@@ -49,6 +58,7 @@ class PcieuniTestSuite : public test_suite {
 
     add(BOOST_CLASS_TEST_CASE(&PcieuniTest::testIoctl, pcieuniTest));
     add(BOOST_CLASS_TEST_CASE(&PcieuniTest::testReadWrite, pcieuniTest));
+    add(BOOST_CLASS_TEST_CASE(&PcieuniTest::testRegisterBatch, pcieuniTest));
     add(BOOST_CLASS_TEST_CASE(&PcieuniTest::testUserFunctions, pcieuniTest));
   }
 };
@@ -68,8 +78,25 @@ void PcieuniTest::testIoctl() {
   device_ioctrl_dma dmaData;
   device_ioctrl_time timeData;
 
+  pcieuni_ring_info ringInfo;
+  pcieuni_ring_dma ringDma;
+  pcieuni_dma_async asyncData;
+  pcieuni_dma_result asyncResult;
+  pcieuni_dma_sg_entry sgEntries[2];
+  pcieuni_dma_sg sgData;
+  pcieuni_event_subscribe eventSubscribe;
+  pcieuni_event event;
+  pcieuni_stream_config streamConfig;
+  pcieuni_stream_slot streamSlot;
+
   float driverVersion;
   int* dmaBuffer;
+  std::vector<int> data(2 * DMA_TEST_SIZE / sizeof(int));
+  int ringFile;
+  size_t ringSize;
+  void* ring;
+  bool collected;
+  bool subscribed;
 
   BOOST_CHECK_NO_THROW(_readerWriter->ioctlExec(PCIEUNI_DRIVER_VERSION, &ioData));
   driverVersion = (float)((float)ioData.offset / 10.0);
@@ -95,6 +122,98 @@ void PcieuniTest::testIoctl() {
   BOOST_CHECK_NO_THROW(_readerWriter->ioctlExec(PCIEUNI_READ_DMA, &dmaBuffer));
   delete dmaBuffer;
 
+  // DMA read into the mmap-able ring
+  BOOST_CHECK_NO_THROW(_readerWriter->ioctlExec(PCIEUNI_RING_INFO, &ringInfo));
+  BOOST_CHECK(ringInfo.slot_count > 0);
+  BOOST_CHECK(ringInfo.slot_size >= DMA_TEST_SIZE);
+  ringFile = open((std::string("/dev/") + PCIEUNI_NAME + PCIEUNI_SLOT).c_str(), O_RDONLY);
+  BOOST_REQUIRE(ringFile >= 0);
+  ringSize = (size_t)ringInfo.slot_count * ringInfo.slot_size;
+  ring = mmap(0, ringSize, PROT_READ, MAP_SHARED, ringFile, 0);
+  BOOST_CHECK(ring != MAP_FAILED);
+  memset(&ringDma, 0, sizeof(ringDma));
+  ringDma.dma_offset = 0;
+  ringDma.dma_size = DMA_TEST_SIZE;
+  BOOST_CHECK_NO_THROW(_readerWriter->ioctlExec(PCIEUNI_RING_READ_DMA, &ringDma));
+  BOOST_CHECK(ringDma.slot < ringInfo.slot_count);
+  BOOST_CHECK(ringDma.slot_offset == (uint64_t)ringDma.slot * ringInfo.slot_size);
+  BOOST_CHECK_NO_THROW(_readerWriter->ioctlExec(PCIEUNI_RING_RELEASE, &ringDma.slot));
+  // a slot can be handed back only once
+  BOOST_CHECK_THROW(_readerWriter->ioctlExec(PCIEUNI_RING_RELEASE, &ringDma.slot), DeviceIOException);
+  if(ring != MAP_FAILED) munmap(ring, ringSize);
+  close(ringFile);
+
+  // Asynchronous DMA read, collected as soon as it is finished
+  memset(&asyncData, 0, sizeof(asyncData));
+  asyncData.dma_offset = 0;
+  asyncData.dma_size = DMA_TEST_SIZE;
+  BOOST_CHECK_NO_THROW(_readerWriter->ioctlExec(PCIEUNI_DMA_SUBMIT, &asyncData));
+  memset(&asyncResult, 0, sizeof(asyncResult));
+  asyncResult.data = (uintptr_t)&data[0];
+  collected = false;
+  for(int i = 0; i < 1000 && !collected; ++i) {
+    try {
+      _readerWriter->ioctlExec(PCIEUNI_DMA_COLLECT, &asyncResult);
+      collected = true;
+    }
+    catch(DeviceIOException&) {
+      // not finished yet
+      usleep(1000);
+    }
+  }
+  BOOST_CHECK(collected);
+  BOOST_CHECK(asyncResult.id == asyncData.id);
+  BOOST_CHECK(asyncResult.status == 0);
+  BOOST_CHECK(asyncResult.dma_size == DMA_TEST_SIZE);
+
+  // Scatter/gather DMA read of two regions
+  memset(sgEntries, 0, sizeof(sgEntries));
+  sgEntries[0].data = (uintptr_t)&data[0];
+  sgEntries[0].dma_offset = 0;
+  sgEntries[0].dma_size = DMA_TEST_SIZE;
+  sgEntries[1].data = (uintptr_t)&data[DMA_TEST_SIZE / sizeof(int)];
+  sgEntries[1].dma_offset = DMA_TEST_SIZE;
+  sgEntries[1].dma_size = DMA_TEST_SIZE;
+  memset(&sgData, 0, sizeof(sgData));
+  sgData.entries = (uintptr_t)sgEntries;
+  sgData.count = 2;
+  BOOST_CHECK_NO_THROW(_readerWriter->ioctlExec(PCIEUNI_READ_DMA_SG, &sgData));
+  sgData.count = PCIEUNI_DMA_SG_MAX + 1;
+  BOOST_CHECK_THROW(_readerWriter->ioctlExec(PCIEUNI_READ_DMA_SG, &sgData), DeviceIOException);
+
+  // Events are only told apart from the end of DMA with MSI and the DMA status register (dma_status_reg)
+  memset(&eventSubscribe, 0, sizeof(eventSubscribe));
+  eventSubscribe.eventfd = -1;
+  subscribed = true;
+  try {
+    _readerWriter->ioctlExec(PCIEUNI_EVENT_SUBSCRIBE, &eventSubscribe);
+  }
+  catch(DeviceIOException&) {
+    printf("EVENTS NOT SUPPORTED BY THE DRIVER CONFIGURATION\n");
+    subscribed = false;
+  }
+  if(subscribed) {
+    BOOST_CHECK_NO_THROW(_readerWriter->ioctlExec(PCIEUNI_EVENT_READ, &event));
+    BOOST_CHECK(event.pending <= event.count);
+    BOOST_CHECK_NO_THROW(_readerWriter->ioctlExec(PCIEUNI_EVENT_UNSUBSCRIBE, 0));
+  }
+
+  // Streaming acquisition into the ring
+  memset(&streamConfig, 0, sizeof(streamConfig));
+  streamConfig.dma_offset = 0;
+  streamConfig.dma_size = DMA_TEST_SIZE;
+  streamConfig.period_us = 1000;
+  BOOST_CHECK_NO_THROW(_readerWriter->ioctlExec(PCIEUNI_STREAM_START, &streamConfig));
+  BOOST_CHECK(streamConfig.slots > 0);
+  // only one stream per board
+  BOOST_CHECK_THROW(_readerWriter->ioctlExec(PCIEUNI_STREAM_START, &streamConfig), DeviceIOException);
+  BOOST_CHECK_NO_THROW(_readerWriter->ioctlExec(PCIEUNI_STREAM_NEXT, &streamSlot));
+  BOOST_CHECK(streamSlot.seq == 0);
+  BOOST_CHECK(streamSlot.dma_size == DMA_TEST_SIZE);
+  BOOST_CHECK(streamSlot.slot < ringInfo.slot_count);
+  BOOST_CHECK_NO_THROW(_readerWriter->ioctlExec(PCIEUNI_STREAM_RELEASE, 0));
+  BOOST_CHECK_NO_THROW(_readerWriter->ioctlExec(PCIEUNI_STREAM_STOP, 0));
+
   // Driver slot and board number
   BOOST_CHECK_NO_THROW(_readerWriter->ioctlExec(PCIEUNI_GET_DMA_TIME, &timeData));
   BOOST_CHECK(timeData.start_time.tv_sec == timeData.stop_time.tv_sec);
@@ -133,6 +252,61 @@ void PcieuniTest::testReadWrite() {
   BOOST_CHECK_THROW(_readerWriter->writeSingle((6LL) << 60, 0, 4, 1), DeviceIOException);
 }
 
+void PcieuniTest::testRegisterBatch() {
+  pcieuni_reg_op ops[4];
+  pcieuni_reg_batch batch;
+
+  // Write and read back in the designated spots on bar 0 and bar 1, all under one device lock
+  memset(ops, 0, sizeof(ops));
+  ops[0].offset = WORD_RESET_N;
+  ops[0].value = 1;
+  ops[0].bar = 0;
+  ops[0].mode = RW_D32;
+  ops[0].cmd = PCIEUNI_REG_WRITE;
+  ops[1] = ops[0];
+  ops[1].cmd = PCIEUNI_REG_READ;
+  ops[2].offset = WORD_TIMING_FREQ;
+  ops[2].value = 81250000;
+  ops[2].bar = 1;
+  ops[2].mode = RW_D32;
+  ops[2].cmd = PCIEUNI_REG_WRITE;
+  ops[3] = ops[2];
+  ops[3].value = 0;
+  ops[3].cmd = PCIEUNI_REG_READ;
+
+  memset(&batch, 0, sizeof(batch));
+  batch.ops = (uintptr_t)ops;
+  batch.count = 4;
+  BOOST_CHECK_NO_THROW(_readerWriter->ioctlExec(PCIEUNI_REG_BATCH, &batch));
+  BOOST_CHECK(ops[3].value == 81250000);
+
+  // An invalid operation fails the whole batch
+  ops[1].offset = WORD_RESET_N + 1;
+  BOOST_CHECK_THROW(_readerWriter->ioctlExec(PCIEUNI_REG_BATCH, &batch), DeviceIOException);
+  ops[1].offset = WORD_RESET_N;
+  ops[1].mode = RW_D32 + 1;
+  BOOST_CHECK_THROW(_readerWriter->ioctlExec(PCIEUNI_REG_BATCH, &batch), DeviceIOException);
+  ops[1].mode = RW_D32;
+  ops[1].reserved = 1;
+  BOOST_CHECK_THROW(_readerWriter->ioctlExec(PCIEUNI_REG_BATCH, &batch), DeviceIOException);
+  ops[1].reserved = 0;
+  // the DMA size register of the DMA engine on bar 2 may be read but not written
+  ops[1].offset = 0xC;
+  ops[1].bar = 2;
+  BOOST_CHECK_THROW(_readerWriter->ioctlExec(PCIEUNI_REG_BATCH, &batch), DeviceIOException);
+  ops[1].cmd = PCIEUNI_REG_RMW;
+  BOOST_CHECK_THROW(_readerWriter->ioctlExec(PCIEUNI_REG_BATCH, &batch), DeviceIOException);
+  ops[1] = ops[0];
+  ops[1].cmd = PCIEUNI_REG_READ;
+  batch.reserved = 1;
+  BOOST_CHECK_THROW(_readerWriter->ioctlExec(PCIEUNI_REG_BATCH, &batch), DeviceIOException);
+  batch.reserved = 0;
+
+  // Try to execute too many operations at once
+  batch.count = PCIEUNI_REG_BATCH_MAX + 1;
+  BOOST_CHECK_THROW(_readerWriter->ioctlExec(PCIEUNI_REG_BATCH, &batch), DeviceIOException);
+}
+
 void PcieuniTest::testUserFunctions() {
   BOOST_CHECK_NO_THROW(_readerWriter->procFileTest(std::string("/proc/") + PCIEUNI_NAME + PCIEUNI_SLOT));
 }
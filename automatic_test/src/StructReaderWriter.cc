@@ -19,7 +19,7 @@ int32_t StructReaderWriter::readSingle(uint64_t offset, uint32_t bar, uint32_t c
 
 void StructReaderWriter::readArea(uint64_t offset, uint32_t bar, uint32_t count, uint32_t nWords, int32_t* readBuffer) {
   for(uint32_t i = 0; i < nWords; ++i) {
-    readBuffer[i] = readSingle(offset + i, count, bar);
+    readBuffer[i] = readSingle(offset + i * count, count, bar);
   }
 }
 
@@ -0,0 +1,64 @@
+/**
+ *  @file   pcieuni_bar_mmap.c
+ *  @brief  Mapping of the board BARs into user space
+ *
+ *  A BAR is mapped with mmap() on the device file at PCIEUNI_MMAP_BAR(bar) (uncached) or PCIEUNI_MMAP_BAR_WC(bar)
+ *  (write-combining), see pcieuni_drv_io.h. Register access is then done with plain loads and stores without a
+ *  system call. Like pread()/pwrite() on the device file, such access is not serialized with other processes.
+ */
+
+#include "pcieuni_fnc.h"
+#include <linux/io.h>
+#include <linux/mm.h>
+#include <linux/pci.h>
+
+/**
+ * @brief Checks whether a mapping offset selects a BAR instead of the DMA ring
+ *
+ * @param vma  User-space memory area
+ *
+ * @return true if the area is a BAR mapping
+ */
+bool pcieuni_bar_mmap_requested(struct vm_area_struct* vma) {
+  return ((u64)vma->vm_pgoff << PAGE_SHIFT) >= PCIEUNI_MMAP_BAR(0);
+}
+
+/**
+ * @brief Maps (part of) a BAR into user space
+ *
+ * @param dev  Target device
+ * @param vma  User-space memory area, the offset is PCIEUNI_MMAP_BAR(bar) or PCIEUNI_MMAP_BAR_WC(bar) plus the
+ *             page-aligned offset inside the BAR
+ *
+ * @retval 0        Success
+ * @retval -EINVAL  No such memory BAR, the BAR start or length is not page aligned or the requested range is outside
+ *                  the BAR
+ * @retval -EAGAIN  Failed to map the BAR
+ */
+int pcieuni_bar_mmap(pcieuni_dev* dev, struct vm_area_struct* vma) {
+  u64 mapOffset = (u64)vma->vm_pgoff << PAGE_SHIFT;
+  u64 barIndex = (mapOffset >> PCIEUNI_MMAP_BAR_SHIFT) - 1;
+  bool writeCombine = mapOffset & PCIEUNI_MMAP_WC;
+  u64 barOffset = mapOffset & (PCIEUNI_MMAP_WC - 1);
+  unsigned long size = vma->vm_end - vma->vm_start;
+  resource_size_t barStart, barLen;
+
+  PDEBUG(dev->name, "pcieuni_bar_mmap(bar=%llu, offset=0x%llx, size=0x%lx, wc=%d)", barIndex, barOffset, size,
+      writeCombine);
+
+  if(barIndex > 5) return -EINVAL;
+  if(!(pci_resource_flags(dev->pcieuni_pci_dev, barIndex) & IORESOURCE_MEM)) return -EINVAL;
+
+  barStart = pci_resource_start(dev->pcieuni_pci_dev, barIndex);
+  barLen = pci_resource_len(dev->pcieuni_pci_dev, barIndex);
+  // a partial page would expose whatever else is decoded in that page, so sub-page BARs are not mapped at all
+  if(!PAGE_ALIGNED(barStart) || !PAGE_ALIGNED(barLen) || barOffset + size > barLen) return -EINVAL;
+
+  vma->vm_page_prot = writeCombine ? pgprot_writecombine(vma->vm_page_prot) : pgprot_noncached(vma->vm_page_prot);
+
+  if(io_remap_pfn_range(vma, vma->vm_start, (barStart + barOffset) >> PAGE_SHIFT, size, vma->vm_page_prot)) {
+    return -EAGAIN;
+  }
+
+  return 0;
+}
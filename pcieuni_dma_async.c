@@ -0,0 +1,292 @@
+/**
+ *  @file   pcieuni_dma_async.c
+ *  @brief  Implementation of asynchronous DMA read
+ *
+ *  A process submits DMA read requests without blocking. The requests are processed one after another by a work
+ *  item of the board, running on the workqueue of the module near the board's NUMA node. Finished requests are
+ *  signalled through poll() on the device file and their data is collected with a separate IOCTL.
+ */
+
+#include "pcieuni_fnc.h"
+#include <gpcieuni/pcieuni_buffer.h>
+#include <linux/poll.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/workqueue.h>
+
+/**
+ * @brief Workqueue of the asynchronous DMA requests of all boards
+ *
+ * The work items block for the whole DMA transfer, so they get a workqueue of their own instead of holding up the
+ * system workqueue.
+ */
+static struct workqueue_struct* pcieuni_async_wq;
+
+/**
+ * @brief Frees asynchronous DMA request together with the DMA buffer it holds
+ *
+ * @param mdev  Target device
+ * @param req   Request that is no longer in any request list
+ */
+static void pcieuni_dma_async_free(module_dev* mdev, pcieuni_dma_request* req) {
+  if(!IS_ERR_OR_NULL(req->buffer)) {
+    pcieuni_bufferList_set_free(&mdev->dmaBuffers, req->buffer);
+  }
+  pcieuni_dma_unhold_buffer(mdev);
+  kfree(req);
+}
+
+/**
+ * @brief Work function processing the queue of submitted asynchronous DMA requests
+ *
+ * @param work  module_dev::asyncWork
+ */
+static void pcieuni_dma_async_work(struct work_struct* work) {
+  module_dev* mdev = container_of(work, module_dev, asyncWork);
+  pcieuni_dma_request* req;
+  bool orphaned;
+
+  for(;;) {
+    spin_lock(&mdev->asyncLock);
+    req = list_first_entry_or_null(&mdev->asyncQueue, pcieuni_dma_request, list);
+    if(req) list_del_init(&req->list);
+    mdev->asyncActive = req;
+    spin_unlock(&mdev->asyncLock);
+
+    if(!req) break;
+
+    PDEBUG(mdev->parent_dev->name, "pcieuni_dma_async_work(id=%u, offset=0x%lx, size=0x%lx)", req->id,
+        req->dma_offset, req->dataSize);
+
+    req->buffer = pcieuni_dma_read_to_buffer(mdev->parent_dev, req->dma_offset, req->dataSize);
+    req->status = IS_ERR(req->buffer) ? PTR_ERR(req->buffer) : 0;
+
+    spin_lock(&mdev->asyncLock);
+    mdev->asyncActive = 0;
+    orphaned = !req->owner;
+    if(!orphaned) list_add_tail(&req->list, &mdev->asyncDone);
+    spin_unlock(&mdev->asyncLock);
+
+    if(orphaned) {
+      pcieuni_dma_async_free(mdev, req);
+    }
+    else {
+      wake_up_interruptible(&mdev->asyncWait);
+    }
+  }
+}
+
+/**
+ * @brief Creates the workqueue of the asynchronous DMA requests
+ *
+ * @retval 0        Success
+ * @retval -ENOMEM  Failed to allocate the workqueue
+ */
+int pcieuni_dma_async_init_module(void) {
+  pcieuni_async_wq = alloc_workqueue(DEVNAME "_async", WQ_UNBOUND | WQ_HIGHPRI, 0);
+  return pcieuni_async_wq ? 0 : -ENOMEM;
+}
+
+/**
+ * @brief Destroys the workqueue of the asynchronous DMA requests
+ * @note The work items of all boards must be cancelled before.
+ */
+void pcieuni_dma_async_cleanup_module(void) {
+  destroy_workqueue(pcieuni_async_wq);
+  pcieuni_async_wq = 0;
+}
+
+/**
+ * @brief Initializes asynchronous DMA read part of the driver device structure
+ *
+ * @param mdev  Target device
+ */
+void pcieuni_dma_async_init(module_dev* mdev) {
+  INIT_LIST_HEAD(&mdev->asyncQueue);
+  INIT_LIST_HEAD(&mdev->asyncDone);
+  spin_lock_init(&mdev->asyncLock);
+  INIT_WORK(&mdev->asyncWork, pcieuni_dma_async_work);
+  init_waitqueue_head(&mdev->asyncWait);
+  mdev->asyncActive = 0;
+  mdev->asyncNextId = 0;
+}
+
+/**
+ * @brief Stops processing of asynchronous DMA requests and drops all of them
+ * @note This function may block.
+ *
+ * @param mdev  Target device
+ */
+void pcieuni_dma_async_cleanup(module_dev* mdev) {
+  pcieuni_dma_request* req;
+  pcieuni_dma_request* tmp;
+  LIST_HEAD(dropped);
+
+  cancel_work_sync(&mdev->asyncWork);
+
+  spin_lock(&mdev->asyncLock);
+  list_splice_init(&mdev->asyncQueue, &dropped);
+  list_splice_tail_init(&mdev->asyncDone, &dropped);
+  spin_unlock(&mdev->asyncLock);
+
+  list_for_each_entry_safe(req, tmp, &dropped, list) {
+    list_del(&req->list);
+    pcieuni_dma_async_free(mdev, req);
+  }
+}
+
+/**
+ * @brief Submits asynchronous DMA read request
+ *
+ * The request holds one DMA buffer from submission until it is collected, so its size is limited to the size of a
+ * DMA buffer.
+ *
+ * @param mdev        Target device
+ * @param filp        Submitting file
+ * @param devOffset   DMA offset to read from
+ * @param dataSize    Size of data to be read
+ * @param id          Returns id of the request
+ *
+ * @retval 0        Success
+ * @retval -EINVAL  Data does not fit into a DMA buffer
+ * @retval -EBUSY   Too many DMA buffers are held by pending requests or the buffers are being replaced
+ * @retval -ENOMEM  Failed to allocate request
+ */
+int pcieuni_dma_async_submit(
+    module_dev* mdev, struct file* filp, unsigned long devOffset, unsigned long dataSize, u32* id) {
+  int retVal = 0;
+  pcieuni_dma_request* req;
+
+  PDEBUG(mdev->parent_dev->name, "pcieuni_dma_async_submit(offset=0x%lx, size=0x%lx)", devOffset, dataSize);
+
+  // a held buffer also keeps the buffers from being replaced while their size is checked
+  retVal = pcieuni_dma_hold_buffer(mdev);
+  if(retVal) return retVal;
+
+  if(!dataSize || PCIEUNI_DMA_SYZE * DIV_ROUND_UP(dataSize, PCIEUNI_DMA_SYZE) > mdev->dmaSlots[0].buffer->size) {
+    pcieuni_dma_unhold_buffer(mdev);
+    return -EINVAL;
+  }
+
+  req = kzalloc(sizeof(pcieuni_dma_request), GFP_KERNEL);
+  if(!req) {
+    pcieuni_dma_unhold_buffer(mdev);
+    return -ENOMEM;
+  }
+  req->owner = filp;
+  req->dma_offset = devOffset;
+  req->dataSize = dataSize;
+
+  spin_lock(&mdev->asyncLock);
+  req->id = mdev->asyncNextId++;
+  list_add_tail(&req->list, &mdev->asyncQueue);
+  spin_unlock(&mdev->asyncLock);
+
+  *id = req->id;
+  queue_work_node(mdev->node, pcieuni_async_wq, &mdev->asyncWork);
+
+  return 0;
+}
+
+/**
+ * @brief Collects the oldest finished asynchronous DMA request of a file
+ *
+ * The data is copied to the user-space address given in result->data.
+ *
+ * @param mdev    Target device
+ * @param filp    File that submitted the request
+ * @param result  Target address on input, request result on output
+ *
+ * @retval 0        Success, see result->status for the result of the DMA read
+ * @retval -EAGAIN  No finished request
+ * @retval -EFAULT  Failed to copy data to user space, request stays finished
+ */
+int pcieuni_dma_async_collect(module_dev* mdev, struct file* filp, pcieuni_dma_result* result) {
+  pcieuni_dma_request* req = 0;
+  pcieuni_dma_request* iter;
+
+  spin_lock(&mdev->asyncLock);
+  list_for_each_entry(iter, &mdev->asyncDone, list) {
+    if(iter->owner == filp) {
+      req = iter;
+      list_del_init(&req->list);
+      break;
+    }
+  }
+  spin_unlock(&mdev->asyncLock);
+
+  if(!req) return -EAGAIN;
+
+  if(!req->status &&
+      copy_to_user((void __user*)(uintptr_t)result->data, (void*)req->buffer->kaddr, req->dataSize)) {
+    spin_lock(&mdev->asyncLock);
+    list_add(&req->list, &mdev->asyncDone);
+    spin_unlock(&mdev->asyncLock);
+    return -EFAULT;
+  }
+
+  result->id = req->id;
+  result->status = req->status;
+  result->dma_size = req->status ? 0 : req->dataSize;
+
+  pcieuni_dma_async_free(mdev, req);
+  return 0;
+}
+
+/**
+ * @brief Poll handler - device file is readable while a finished request of the file can be collected
+ *
+ * @param mdev  Target device
+ * @param filp  Polled file
+ * @param wait  Poll table
+ *
+ * @return Poll mask
+ */
+__poll_t pcieuni_dma_async_poll(module_dev* mdev, struct file* filp, struct poll_table_struct* wait) {
+  __poll_t mask = 0;
+  pcieuni_dma_request* req;
+
+  poll_wait(filp, &mdev->asyncWait, wait);
+
+  spin_lock(&mdev->asyncLock);
+  list_for_each_entry(req, &mdev->asyncDone, list) {
+    if(req->owner == filp) {
+      mask |= EPOLLIN | EPOLLRDNORM;
+      break;
+    }
+  }
+  spin_unlock(&mdev->asyncLock);
+
+  return mask;
+}
+
+/**
+ * @brief Drops all asynchronous DMA requests of a file
+ *
+ * A request being processed is freed by the work function once it is finished.
+ *
+ * @param mdev  Target device
+ * @param filp  File being closed
+ */
+void pcieuni_dma_async_release_file(module_dev* mdev, struct file* filp) {
+  pcieuni_dma_request* req;
+  pcieuni_dma_request* tmp;
+  LIST_HEAD(dropped);
+
+  spin_lock(&mdev->asyncLock);
+  list_for_each_entry_safe(req, tmp, &mdev->asyncQueue, list) {
+    if(req->owner == filp) list_move_tail(&req->list, &dropped);
+  }
+  list_for_each_entry_safe(req, tmp, &mdev->asyncDone, list) {
+    if(req->owner == filp) list_move_tail(&req->list, &dropped);
+  }
+  if(mdev->asyncActive && mdev->asyncActive->owner == filp) {
+    mdev->asyncActive->owner = 0;
+  }
+  spin_unlock(&mdev->asyncLock);
+
+  list_for_each_entry_safe(req, tmp, &dropped, list) {
+    list_del(&req->list);
+    pcieuni_dma_async_free(mdev, req);
+  }
+}
@@ -0,0 +1,191 @@
+/**
+ *  @file   pcieuni_dma_merge.c
+ *  @brief  Merging of identical DMA reads
+ *
+ *  When enabled with ::dma_merge, a DMA read with the same offset and size as a read already in progress on the board
+ *  does not start another DMA transfer. It waits for the running read and gets a copy of its data. With
+ *  ::dma_merge_fresh_us the result of the last read is also handed out to reads arriving shortly after it finished.
+ *  Only reads up to ::dma_merge_max_sz_kb are merged: the merged data passes through a kernel copy, larger reads keep
+ *  their direct path into the user buffer.
+ */
+
+#include "pcieuni_fnc.h"
+#include <linux/completion.h>
+#include <linux/kref.h>
+#include <linux/mm.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+
+/**
+ * @brief Module parameter - merge concurrent DMA reads of the same offset and size into one DMA transfer
+ */
+static bool dma_merge = false;
+module_param(dma_merge, bool, S_IRUGO | S_IWUSR);
+
+/**
+ * @brief Module parameter - time (in us) the result of a merged DMA read is handed out to later identical reads
+ *
+ * 0 merges only reads that arrive while the DMA transfer is running.
+ */
+static unsigned int dma_merge_fresh_us = 0;
+module_param(dma_merge_fresh_us, uint, S_IRUGO | S_IWUSR);
+
+/**
+ * @brief Module parameter - maximum size (in kB) of a merged DMA read
+ *
+ * 0 merges reads up to the size of one DMA buffer of the board. Larger reads and reads above 2 GB are never merged.
+ */
+static unsigned int dma_merge_max_sz_kb = 0;
+module_param(dma_merge_max_sz_kb, uint, S_IRUGO | S_IWUSR);
+
+/**
+ * @brief Result of a DMA read shared by all identical reads merged into it
+ */
+struct pcieuni_dma_share {
+  struct kref ref;          /**< Held by module_dev::dmaShare and by every reader of the share */
+  unsigned long dma_offset; /**< DMA offset of the read */
+  unsigned long dataSize;   /**< Size of the read */
+  void* data;               /**< Data of the read, valid once finished with status 0 */
+  int status;               /**< Result of the read (0 or negative error code) */
+  bool finished;            /**< Read finished, protected by module_dev::dmaShareMutex */
+  u64 doneNs;               /**< Time the read finished (ktime_get_ns()), protected by module_dev::dmaShareMutex */
+  struct completion done;   /**< Completed when the read is finished */
+};
+typedef struct pcieuni_dma_share pcieuni_dma_share;
+
+/**
+ * @brief Frees a shared DMA read result once its last reference is dropped
+ *
+ * @param ref  pcieuni_dma_share::ref
+ */
+static void pcieuni_dma_share_free(struct kref* ref) {
+  pcieuni_dma_share* share = container_of(ref, pcieuni_dma_share, ref);
+
+  kvfree(share->data);
+  kfree(share);
+}
+
+/**
+ * @brief Checks whether a DMA read can be merged into a shared DMA read result
+ * @note Called with module_dev::dmaShareMutex held.
+ *
+ * @param share       Shared result or NULL
+ * @param devOffset   DMA offset to read from
+ * @param dataSize    Size of data to be read
+ *
+ * @return true if the read gets the data of the shared result
+ */
+static bool pcieuni_dma_share_match(pcieuni_dma_share* share, unsigned long devOffset, unsigned long dataSize) {
+  if(!share || share->dma_offset != devOffset || share->dataSize != dataSize) return false;
+  if(!share->finished) return true;
+  return !share->status && ktime_get_ns() - share->doneNs <= (u64)dma_merge_fresh_us * NSEC_PER_USEC;
+}
+
+/**
+ * @brief Reads from board memory via DMA, merging identical reads if enabled
+ *
+ * The first read of an offset and size performs the DMA transfer into a kernel copy of the data and hands it to its
+ * caller. Identical reads arriving meanwhile (or within ::dma_merge_fresh_us afterwards) get that copy. If the first
+ * read fails, every merged read falls back to a DMA transfer of its own. Reads larger than ::dma_merge_max_sz_kb go
+ * to pcieuni_dma_read() unmerged.
+ * @note This function may block.
+ *
+ * @param dev         Target device
+ * @param devOffset   DMA offset to read from
+ * @param dataSize    Size of data to be read
+ * @param userBuffer  Target user-space buffer
+ *
+ * @retval  0             Success
+ * @retval  -ERESTARTSYS  Interrupted while waiting for a merged read
+ * @retval  -EFAULT       Failed to copy data to userspace
+ * @retval  <0            Error code of pcieuni_dma_read_segments() or pcieuni_dma_read()
+ */
+int pcieuni_dma_read_merged(pcieuni_dev* dev, unsigned long devOffset, unsigned long dataSize, void* userBuffer) {
+  int retVal = 0;
+  pcieuni_dma_share* share;
+  pcieuni_dma_share* old;
+  pcieuni_dma_segment segment = {.devOffset = devOffset, .dataSize = dataSize};
+  struct module_dev* mdev = pcieuni_get_mdev(dev);
+  unsigned long maxSize = READ_ONCE(mdev->dmaBufferSize);
+
+  if(dma_merge_max_sz_kb) maxSize = min((unsigned long)dma_merge_max_sz_kb * 1024, (unsigned long)INT_MAX);
+  if(!dma_merge || !dataSize || dataSize > maxSize) return pcieuni_dma_read(dev, devOffset, dataSize, userBuffer);
+
+  if(mutex_lock_interruptible(&mdev->dmaShareMutex)) return -ERESTARTSYS;
+
+  share = mdev->dmaShare;
+  if(pcieuni_dma_share_match(share, devOffset, dataSize)) {
+    // somebody else is reading (or just read) the same data - use the result
+    kref_get(&share->ref);
+    mutex_unlock(&mdev->dmaShareMutex);
+
+    PDEBUG(dev->name, "pcieuni_dma_read_merged(devOffset=0x%lx, dataSize=0x%lx): merged\n", devOffset, dataSize);
+
+    if(wait_for_completion_interruptible(&share->done)) {
+      kref_put(&share->ref, pcieuni_dma_share_free);
+      return -ERESTARTSYS;
+    }
+
+    if(share->status) {
+      retVal = pcieuni_dma_read(dev, devOffset, dataSize, userBuffer);
+    }
+    else {
+      retVal = copy_to_user(userBuffer, share->data, dataSize) ? -EFAULT : 0;
+      atomic64_inc(&mdev->stats.mergedReads);
+    }
+    kref_put(&share->ref, pcieuni_dma_share_free);
+    return retVal;
+  }
+
+  // become the reader of a new shared result
+  share = kzalloc(sizeof(pcieuni_dma_share), GFP_KERNEL);
+  if(share) share->data = kvmalloc(dataSize, GFP_KERNEL);
+  if(!share || !share->data) {
+    mutex_unlock(&mdev->dmaShareMutex);
+    kfree(share);
+    return pcieuni_dma_read(dev, devOffset, dataSize, userBuffer);
+  }
+  kref_init(&share->ref); // reference of module_dev::dmaShare
+  kref_get(&share->ref);  // own reference
+  share->dma_offset = devOffset;
+  share->dataSize = dataSize;
+  init_completion(&share->done);
+
+  old = mdev->dmaShare;
+  mdev->dmaShare = share;
+  mutex_unlock(&mdev->dmaShareMutex);
+  if(old) kref_put(&old->ref, pcieuni_dma_share_free);
+
+  // the shared data comes from the driver buffers only, never back from the user space of the reader
+  segment.kernelBuffer = share->data;
+  share->status = pcieuni_dma_read_segments(dev, &segment, 1, 0);
+  retVal = share->status;
+  if(!retVal && copy_to_user(userBuffer, share->data, dataSize)) retVal = -EFAULT;
+
+  mutex_lock(&mdev->dmaShareMutex);
+  share->finished = true;
+  share->doneNs = ktime_get_ns();
+  if(share->status && mdev->dmaShare == share) {
+    mdev->dmaShare = 0;
+    kref_put(&share->ref, pcieuni_dma_share_free);
+  }
+  mutex_unlock(&mdev->dmaShareMutex);
+
+  complete_all(&share->done);
+  kref_put(&share->ref, pcieuni_dma_share_free);
+
+  return retVal;
+}
+
+/**
+ * @brief Drops the shared DMA read result of a board
+ *
+ * @param mdev  Target device
+ */
+void pcieuni_dma_merge_cleanup(module_dev* mdev) {
+  if(mdev->dmaShare) {
+    kref_put(&mdev->dmaShare->ref, pcieuni_dma_share_free);
+    mdev->dmaShare = 0;
+  }
+}
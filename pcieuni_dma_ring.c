@@ -0,0 +1,259 @@
+/**
+ *  @file   pcieuni_dma_ring.c
+ *  @brief  Implementation of the mmap-able DMA ring
+ *
+ *  The preallocated DMA buffers of a board can be mapped read-only into user space. A process requests DMA into a
+ *  ring slot, reads the data in place and hands the slot back when it is done with it.
+ */
+
+#include "pcieuni_fnc.h"
+#include <gpcieuni/pcieuni_buffer.h>
+#include <linux/io.h>
+#include <linux/mm.h>
+#include <linux/scatterlist.h>
+#include <linux/version.h>
+
+/**
+ * @brief Returns slot index of a preallocated DMA buffer
+ *
+ * @param mdev    Target device
+ * @param buffer  DMA buffer
+ *
+ * @return Slot index or -1 if buffer is not part of the ring
+ */
+int pcieuni_dma_ring_slot(module_dev* mdev, pcieuni_buffer* buffer) {
+  int i;
+
+  for(i = 0; i < mdev->dmaSlotCount; i++) {
+    if(mdev->dmaSlots[i].buffer == buffer) return i;
+  }
+  return -1;
+}
+
+/**
+ * @brief Counts a new mapping of the DMA ring (e.g. after fork())
+ *
+ * @param vma  User-space memory area
+ */
+static void pcieuni_dma_ring_vm_open(struct vm_area_struct* vma) {
+  module_dev* mdev = vma->vm_private_data;
+
+  spin_lock(&mdev->dmaSlotLock);
+  mdev->dmaRingMaps++;
+  spin_unlock(&mdev->dmaSlotLock);
+}
+
+/**
+ * @brief Counts a removed mapping of the DMA ring
+ *
+ * @param vma  User-space memory area
+ */
+static void pcieuni_dma_ring_vm_close(struct vm_area_struct* vma) {
+  module_dev* mdev = vma->vm_private_data;
+
+  spin_lock(&mdev->dmaSlotLock);
+  mdev->dmaRingMaps--;
+  spin_unlock(&mdev->dmaSlotLock);
+}
+
+/**
+ * @brief Mapping of the DMA ring, counted so that the buffers are not replaced while they are mapped
+ */
+static const struct vm_operations_struct pcieuni_dma_ring_vm_ops = {
+    .open = pcieuni_dma_ring_vm_open,
+    .close = pcieuni_dma_ring_vm_close,
+};
+
+/**
+ * @brief Maps a page range of a ring slot into user space
+ *
+ * A physically contiguous buffer is mapped in one piece, a buffer contiguous only in IOVA space page by page.
+ *
+ * @param vma     User-space memory area
+ * @param slot    Slot of the ring
+ * @param addr    User-space address of the range
+ * @param offset  Offset of the range in the buffer (page aligned)
+ * @param size    Size of the range (page aligned)
+ *
+ * @retval 0        Success
+ * @retval <0       Error code of remap_pfn_range()
+ */
+static int pcieuni_dma_ring_map_slot(
+    struct vm_area_struct* vma, pcieuni_dma_slot* slot, unsigned long addr, unsigned long offset, unsigned long size) {
+  struct sg_page_iter iter;
+  int retVal;
+
+  if(!slot->pages) {
+    return remap_pfn_range(
+        vma, addr, (virt_to_phys((void*)slot->buffer->kaddr) + offset) >> PAGE_SHIFT, size, vma->vm_page_prot);
+  }
+
+  for_each_sgtable_page(slot->pages, &iter, offset >> PAGE_SHIFT) {
+    if(!size) break;
+    retVal = remap_pfn_range(vma, addr, page_to_pfn(sg_page_iter_page(&iter)), PAGE_SIZE, vma->vm_page_prot);
+    if(retVal) return retVal;
+    addr += PAGE_SIZE;
+    size -= PAGE_SIZE;
+  }
+  return 0;
+}
+
+/**
+ * @brief Maps the DMA ring read-only into user space
+ *
+ * Slot n is mapped at offset n * mdev->dmaSlotSize. Any page range within the ring may be mapped.
+ *
+ * @param mdev  Target device
+ * @param vma   User-space memory area
+ *
+ * @retval 0        Success
+ * @retval -EPERM   Writable mapping was requested
+ * @retval -EINVAL  Requested range is outside the ring
+ * @retval -EBUSY   The buffers are being replaced
+ * @retval -EAGAIN  Failed to map the pages
+ */
+int pcieuni_dma_ring_mmap(module_dev* mdev, struct vm_area_struct* vma) {
+  unsigned long mapStart = vma->vm_pgoff << PAGE_SHIFT;
+  unsigned long mapEnd = mapStart + (vma->vm_end - vma->vm_start);
+  unsigned long slotStart, start, end;
+  pcieuni_buffer* buffer;
+  int i;
+
+  PDEBUG(mdev->parent_dev->name, "pcieuni_dma_ring_mmap(offset=0x%lx, size=0x%lx)", mapStart, mapEnd - mapStart);
+
+  if(vma->vm_flags & VM_WRITE) return -EPERM;
+
+  spin_lock(&mdev->dmaSlotLock);
+  if(mdev->dmaPoolResizing || mapEnd > mdev->dmaSlotCount * mdev->dmaSlotSize) {
+    spin_unlock(&mdev->dmaSlotLock);
+    return mdev->dmaPoolResizing ? -EBUSY : -EINVAL;
+  }
+  mdev->dmaRingMaps++;
+  spin_unlock(&mdev->dmaSlotLock);
+
+  vma->vm_ops = &pcieuni_dma_ring_vm_ops;
+  vma->vm_private_data = mdev;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+  vm_flags_clear(vma, VM_MAYWRITE);
+#else
+  vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+
+  for(i = 0; i < mdev->dmaSlotCount; i++) {
+    buffer = mdev->dmaSlots[i].buffer;
+    slotStart = i * mdev->dmaSlotSize;
+    start = max(mapStart, slotStart);
+    end = min(mapEnd, slotStart + PAGE_ALIGN(buffer->size));
+    if(start >= end) continue;
+
+    if(pcieuni_dma_ring_map_slot(vma, &mdev->dmaSlots[i], vma->vm_start + (start - mapStart), start - slotStart,
+           end - start)) {
+      // close is not called for a failed mmap()
+      pcieuni_dma_ring_vm_close(vma);
+      return -EAGAIN;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Reads from board memory via DMA into a free slot of the DMA ring
+ *
+ * On success the slot is held by the calling file until it is handed back with pcieuni_dma_ring_release() or the
+ * file is closed. At least one buffer is always left for the regular DMA read.
+ * @note This function may block.
+ *
+ * @param dev         Target device
+ * @param filp        File that will hold the slot
+ * @param devOffset   DMA offset to read from
+ * @param dataSize    Size of data to be read
+ * @param slot        Returns index of the slot holding the data
+ * @param slotOffset  Returns offset of the slot in the mapping
+ *
+ * @retval  0          Success
+ * @retval  -EINVAL    Data does not fit into a slot
+ * @retval  -EBUSY     Too many slots are held or target device is busy
+ * @retval  -ENOMEM    Failed to get target driver buffer
+ * @retval  -EINTR     Operation was interupted
+ * @retval  -EIO       Failed to write to device registers or timed out while waiting for end of DMA IRQ
+ */
+int pcieuni_dma_ring_read(pcieuni_dev* dev, struct file* filp, unsigned long devOffset, unsigned long dataSize,
+    u32* slot, u64* slotOffset) {
+  int retVal = 0;
+  int index;
+  pcieuni_buffer* buffer;
+  struct module_dev* mdev = pcieuni_get_mdev(dev);
+
+  PDEBUG(dev->name, "pcieuni_dma_ring_read(devOffset=0x%lx, dataSize=0x%lx)\n", devOffset, dataSize);
+
+  retVal = pcieuni_dma_hold_buffer(mdev);
+  if(retVal) return retVal;
+
+  buffer = pcieuni_dma_read_to_buffer(dev, devOffset, dataSize);
+  if(IS_ERR(buffer)) {
+    pcieuni_dma_unhold_buffer(mdev);
+    return PTR_ERR(buffer);
+  }
+
+  index = pcieuni_dma_ring_slot(mdev, buffer);
+  spin_lock(&mdev->dmaSlotLock);
+  mdev->dmaSlots[index].owner = filp;
+  spin_unlock(&mdev->dmaSlotLock);
+
+  *slot = index;
+  *slotOffset = (u64)index * mdev->dmaSlotSize;
+  return 0;
+}
+
+/**
+ * @brief Hands a held DMA ring slot back to the buffer list
+ *
+ * @param mdev  Target device
+ * @param filp  File holding the slot
+ * @param slot  Slot index
+ *
+ * @retval 0        Success
+ * @retval -EINVAL  Slot is not held by this file
+ */
+int pcieuni_dma_ring_release(module_dev* mdev, struct file* filp, u32 slot) {
+  pcieuni_buffer* buffer;
+
+  PDEBUG(mdev->parent_dev->name, "pcieuni_dma_ring_release(slot=%u)", slot);
+
+  spin_lock(&mdev->dmaSlotLock);
+  if(slot >= mdev->dmaSlotCount || mdev->dmaSlots[slot].owner != filp) {
+    spin_unlock(&mdev->dmaSlotLock);
+    return -EINVAL;
+  }
+  mdev->dmaSlots[slot].owner = 0;
+  buffer = mdev->dmaSlots[slot].buffer;
+  spin_unlock(&mdev->dmaSlotLock);
+
+  pcieuni_bufferList_set_free(&mdev->dmaBuffers, buffer);
+  pcieuni_dma_unhold_buffer(mdev);
+  return 0;
+}
+
+/**
+ * @brief Hands all DMA ring slots held by a file back to the buffer list
+ *
+ * @param mdev  Target device
+ * @param filp  File being closed
+ */
+void pcieuni_dma_ring_release_file(module_dev* mdev, struct file* filp) {
+  u32 i;
+  bool found;
+
+  // the slots are only looked at under the lock, they may be replaced by pcieuni_dma_pool_resize() otherwise
+  do {
+    found = false;
+    spin_lock(&mdev->dmaSlotLock);
+    for(i = 0; i < mdev->dmaSlotCount && !found; i++) {
+      found = mdev->dmaSlots[i].owner == filp;
+    }
+    spin_unlock(&mdev->dmaSlotLock);
+    if(found) pcieuni_dma_ring_release(mdev, filp, i - 1);
+  } while(found);
+}
@@ -0,0 +1,201 @@
+/**
+ *  @file   pcieuni_dma_stats.c
+ *  @brief  Per-board DMA statistics exported through debugfs
+ *
+ *  The counters are updated lock-free in the DMA path (see module_dev::stats). Each board gets a directory
+ *  pcieuni/<device name> in debugfs with a read-only file "stats". Writing anything to the file "reset" clears the
+ *  statistics of the board. The read-only file "info" shows the NUMA placement of the board.
+ */
+
+#include "pcieuni_fnc.h"
+#include <linux/debugfs.h>
+#include <linux/dma-mapping.h>
+#include <linux/math64.h>
+#include <linux/seq_file.h>
+#include <linux/version.h>
+
+/**
+ * @brief debugfs directory of the module
+ */
+static struct dentry* pcieuni_debugfs_root;
+
+/**
+ * @brief Prints non-empty buckets of a latency histogram
+ *
+ * Every bucket is printed with its exclusive upper bound, the open-ended last bucket with its lower bound.
+ *
+ * @param m     Target sequence file
+ * @param name  Name of the histogram
+ * @param hist  Histogram with PCIEUNI_STATS_BUCKETS buckets
+ */
+static void pcieuni_stats_show_hist(struct seq_file* m, const char* name, atomic64_t* hist) {
+  int i;
+  s64 count;
+
+  seq_printf(m, "%s histogram [ns]:\n", name);
+  for(i = 0; i < PCIEUNI_STATS_BUCKETS; i++) {
+    count = atomic64_read(&hist[i]);
+    if(!count) continue;
+    if(i < PCIEUNI_STATS_BUCKETS - 1) {
+      seq_printf(m, "  <  %20llu: %lld\n", 1ULL << i, count);
+    }
+    else {
+      // the last bucket takes everything from the upper bound of the one before
+      seq_printf(m, "  >= %20llu: %lld\n", 1ULL << (i - 1), count);
+    }
+  }
+}
+
+/**
+ * @brief Prints statistics of the board
+ *
+ * @param m  Target sequence file, private data is the module_dev of the board
+ * @param v  Unused
+ *
+ * @retval 0  Success
+ */
+static int pcieuni_stats_show(struct seq_file* m, void* v) {
+  module_dev* mdev = m->private;
+  pcieuni_dma_stats* stats = &mdev->stats;
+  s64 copies = atomic64_read(&stats->copies);
+
+  seq_printf(m, "transfers:       %lld\n", atomic64_read(&stats->transfers));
+  seq_printf(m, "bytes:           %lld\n", atomic64_read(&stats->bytes));
+  seq_printf(m, "timeouts:        %lld\n", atomic64_read(&stats->timeouts));
+  seq_printf(m, "write_timeouts:  %lld\n", atomic64_read(&stats->writeTimeouts));
+  seq_printf(m, "unexpected_irqs: %lld\n", atomic64_read(&stats->irqUnexpected));
+  seq_printf(m, "missed_irqs:     %lld\n", atomic64_read(&stats->irqMissed));
+  seq_printf(m, "queue_waits:     %lld\n", atomic64_read(&stats->queueWaits));
+  seq_printf(m, "copies:          %lld\n", copies);
+  seq_printf(m, "copy_ns:         %lld\n", atomic64_read(&stats->copyNs));
+  seq_printf(m, "copy_ns_avg:     %lld\n", copies ? div64_s64(atomic64_read(&stats->copyNs), copies) : 0);
+  seq_printf(m, "busy_polls:      %lld\n", atomic64_read(&stats->busyPolls));
+  seq_printf(m, "merged_reads:    %lld\n", atomic64_read(&stats->mergedReads));
+  seq_printf(m, "stream_overruns: %lld\n", atomic64_read(&stats->streamOverruns));
+  pcieuni_stats_show_hist(m, "dma_latency", stats->dmaLatency);
+  pcieuni_stats_show_hist(m, "wakeup_latency", stats->wakeLatency);
+
+  return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(pcieuni_stats);
+
+/**
+ * @brief Clears statistics of the board
+ *
+ * @param data  module_dev of the board
+ * @param val   Ignored
+ *
+ * @retval 0  Success
+ */
+static int pcieuni_stats_reset(void* data, u64 val) {
+  module_dev* mdev = data;
+  pcieuni_dma_stats* stats = &mdev->stats;
+  int i;
+
+  atomic64_set(&stats->transfers, 0);
+  atomic64_set(&stats->bytes, 0);
+  atomic64_set(&stats->timeouts, 0);
+  atomic64_set(&stats->writeTimeouts, 0);
+  atomic64_set(&stats->irqUnexpected, 0);
+  atomic64_set(&stats->irqMissed, 0);
+  atomic64_set(&stats->queueWaits, 0);
+  atomic64_set(&stats->copies, 0);
+  atomic64_set(&stats->copyNs, 0);
+  atomic64_set(&stats->busyPolls, 0);
+  atomic64_set(&stats->mergedReads, 0);
+  atomic64_set(&stats->streamOverruns, 0);
+  for(i = 0; i < PCIEUNI_STATS_BUCKETS; i++) {
+    atomic64_set(&stats->dmaLatency[i], 0);
+    atomic64_set(&stats->wakeLatency[i], 0);
+  }
+
+  return 0;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(pcieuni_stats_reset_fops, NULL, pcieuni_stats_reset, "%llu\n");
+
+/**
+ * @brief Tells whether DMA transfers of the board may be bounced through SWIOTLB
+ *
+ * Bouncing is possible if the DMA mask of the board does not reach all memory and no IOMMU remaps the addresses.
+ *
+ * @param mdev  Target device
+ *
+ * @return "yes", "no" or "unknown" on kernels that can not tell
+ */
+static const char* pcieuni_stats_dma_bounce(module_dev* mdev) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 3, 0)
+  return dma_addressing_limited(&mdev->parent_dev->pcieuni_pci_dev->dev) ? "yes" : "no";
+#else
+  return "unknown";
+#endif
+}
+
+/**
+ * @brief Prints NUMA placement of the board
+ *
+ * @param m  Target sequence file, private data is the module_dev of the board
+ * @param v  Unused
+ *
+ * @retval 0  Success
+ */
+static int pcieuni_info_show(struct seq_file* m, void* v) {
+  module_dev* mdev = m->private;
+  int i;
+
+  seq_printf(m, "numa_node:       %d\n", mdev->node);
+  seq_printf(m, "buffers:         %d\n", mdev->dmaSlotCount);
+  seq_printf(m, "buffers_local:   %d\n", mdev->dmaBuffersLocal);
+  for(i = 0; i < mdev->dmaClassCount; i++) {
+    seq_printf(m, "buffer_class:    %d x %lu kB\n", mdev->dmaClasses[i].count, mdev->dmaClasses[i].size / 1024);
+  }
+  seq_printf(m, "dma_addr_bits:   %d\n", mdev->dmaAddr64 ? 64 : 32);
+  seq_printf(m, "dma_bounce:      %s\n", pcieuni_stats_dma_bounce(mdev));
+  seq_printf(m, "irq:             %d\n", mdev->irq);
+  if(mdev->irqAffinity) {
+    seq_printf(m, "irq_cpus:        %*pbl\n", cpumask_pr_args(mdev->irqAffinity));
+  }
+  else {
+    seq_printf(m, "irq_cpus:        any\n");
+  }
+
+  return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(pcieuni_info);
+
+/**
+ * @brief Creates the debugfs directory of the module
+ */
+void pcieuni_stats_init_module(void) {
+  pcieuni_debugfs_root = debugfs_create_dir(DEVNAME, NULL);
+}
+
+/**
+ * @brief Removes the debugfs directory of the module
+ */
+void pcieuni_stats_cleanup_module(void) {
+  debugfs_remove_recursive(pcieuni_debugfs_root);
+  pcieuni_debugfs_root = 0;
+}
+
+/**
+ * @brief Creates the debugfs entries of a board
+ * @note debugfs failures are not fatal, the statistics are then just not visible.
+ *
+ * @param mdev  Target device
+ */
+void pcieuni_stats_add(module_dev* mdev) {
+  mdev->debugfsDir = debugfs_create_dir(mdev->parent_dev->name, pcieuni_debugfs_root);
+  debugfs_create_file("stats", 0444, mdev->debugfsDir, mdev, &pcieuni_stats_fops);
+  debugfs_create_file("info", 0444, mdev->debugfsDir, mdev, &pcieuni_info_fops);
+  debugfs_create_file_unsafe("reset", 0200, mdev->debugfsDir, mdev, &pcieuni_stats_reset_fops);
+}
+
+/**
+ * @brief Removes the debugfs entries of a board
+ *
+ * @param mdev  Target device
+ */
+void pcieuni_stats_remove(module_dev* mdev) {
+  debugfs_remove_recursive(mdev->debugfsDir);
+  mdev->debugfsDir = 0;
+}
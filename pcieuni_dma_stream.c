@@ -0,0 +1,461 @@
+/**
+ *  @file   pcieuni_dma_stream.c
+ *  @brief  Implementation of the streaming acquisition
+ *
+ *  A process starts the stream with the device region to read and the number of DMA ring slots to fill. The driver
+ *  then reads the region into the slots one after another without a system call per read: back to back, with the
+ *  next read queued from the interrupt thread as soon as the previous one is finished, or with a fixed period from a
+ *  timer. The process takes the filled slots in order with PCIEUNI_STREAM_NEXT, reads the data through the mapping
+ *  of the DMA ring and hands them back with PCIEUNI_STREAM_RELEASE. A read that is due while all slots are filled or
+ *  the previous read is not finished yet is skipped and counted as overrun.
+ */
+
+#include "pcieuni_fnc.h"
+#include <gpcieuni/pcieuni_buffer.h>
+#include <linux/dma-mapping.h>
+#include <linux/poll.h>
+#include <linux/slab.h>
+#include <linux/version.h>
+
+static void pcieuni_dma_stream_done(module_dev* mdev, pcieuni_dma_xfer* xfer);
+
+/**
+ * @brief Queues the next read of the stream into the next free slot
+ * @note Called with module_dev::dmaLock held.
+ *
+ * @param mdev  Target device
+ */
+static void pcieuni_dma_stream_arm(module_dev* mdev) {
+  pcieuni_dma_stream* stream = &mdev->stream;
+  pcieuni_buffer* buffer;
+
+  if(!stream->running) return;
+
+  if(stream->filling || stream->fillSeq - stream->doneSeq >= stream->nEntries) {
+    // the device or user space did not keep up - count the skipped read once per stall of a back-to-back stream
+    if(!stream->stalled) {
+      stream->overruns++;
+      atomic64_inc(&mdev->stats.streamOverruns);
+    }
+    // a back-to-back stream goes on when a slot is released, see pcieuni_dma_stream_release()
+    stream->stalled = !stream->periodNs;
+    return;
+  }
+
+  stream->stalled = false;
+  buffer = stream->entries[stream->fillSeq % stream->nEntries].buffer;
+  buffer->dma_offset = stream->devOffset;
+  buffer->dma_size = stream->dmaSize;
+  pcieuni_dma_sync_chunk(mdev, buffer, -1, true);
+  set_bit(BUFFER_STATE_WAITING, &buffer->state);
+
+  stream->xfer.toDevice = false;
+  stream->xfer.done = pcieuni_dma_stream_done;
+  init_completion(&stream->xfer.finished);
+  stream->filling = true;
+  if(pcieuni_dma_queue_locked(mdev, buffer, &stream->xfer)) {
+    // the timer tries again
+    clear_bit(BUFFER_STATE_WAITING, &buffer->state);
+    stream->filling = false;
+  }
+}
+
+/**
+ * @brief Completion callback of a read of the stream
+ * @note Called from the threaded interrupt handler with module_dev::dmaLock held.
+ *
+ * @param mdev  Target device
+ * @param xfer  pcieuni_dma_stream::xfer
+ */
+static void pcieuni_dma_stream_done(module_dev* mdev, pcieuni_dma_xfer* xfer) {
+  pcieuni_dma_stream* stream = &mdev->stream;
+  pcieuni_stream_entry* entry = &stream->entries[stream->fillSeq % stream->nEntries];
+
+  entry->seq = stream->fillSeq++;
+  entry->doneNs = xfer->doneNs;
+  stream->filling = false;
+  wake_up(&stream->wait);
+
+  if(!stream->periodNs) pcieuni_dma_stream_arm(mdev);
+}
+
+/**
+ * @brief Returns the interval of the stream timer
+ *
+ * @param stream  Stream of the board
+ *
+ * @return Period of the reads, or a quarter of the read timeout for a back-to-back stream
+ */
+static ktime_t pcieuni_dma_stream_interval(pcieuni_dma_stream* stream) {
+  return ns_to_ktime(stream->periodNs ? stream->periodNs : stream->timeoutNs / 4);
+}
+
+/**
+ * @brief Timer of the stream - queues periodic reads and looks after reads whose interrupt did not come
+ *
+ * @param timer  pcieuni_dma_stream::timer
+ *
+ * @return HRTIMER_RESTART while the stream is running
+ */
+static enum hrtimer_restart pcieuni_dma_stream_timer(struct hrtimer* timer) {
+  module_dev* mdev = container_of(timer, module_dev, stream.timer);
+  pcieuni_dma_stream* stream = &mdev->stream;
+  unsigned long flags;
+  bool running;
+  int status;
+
+  spin_lock_irqsave(&mdev->dmaLock, flags);
+  // a read finished by the watchdog goes through pcieuni_dma_stream_done() like any other
+  status = stream->filling ? pcieuni_dma_watchdog_locked(mdev, &stream->xfer, stream->timeoutNs) : 0;
+  if(status && status != -EAGAIN) {
+    printk(KERN_ERR "pcieuni(%s): streaming DMA (offset=0x%lx, size=0x%lx): TIMEOUT!\n", mdev->parent_dev->name,
+        stream->devOffset, stream->dmaSize);
+    atomic64_inc(&mdev->stats.timeouts);
+
+    // assuming we missed the interrupt
+    pcieuni_dma_cancel_locked(mdev, stream->entries[stream->fillSeq % stream->nEntries].buffer);
+    stream->filling = false;
+  }
+  // a back-to-back stream is only re-armed here if it was not able to queue a read
+  if(stream->periodNs || (!stream->filling && !stream->stalled)) pcieuni_dma_stream_arm(mdev);
+  running = stream->running;
+  spin_unlock_irqrestore(&mdev->dmaLock, flags);
+
+  if(!running) return HRTIMER_NORESTART;
+  hrtimer_forward_now(timer, pcieuni_dma_stream_interval(stream));
+  return HRTIMER_RESTART;
+}
+
+/**
+ * @brief Stops the stream and hands its buffers back to the buffer list
+ * @note Called with pcieuni_dma_stream::mutex held. This function may block.
+ *
+ * @param mdev  Target device
+ */
+static void pcieuni_dma_stream_shutdown(module_dev* mdev) {
+  pcieuni_dma_stream* stream = &mdev->stream;
+  pcieuni_stream_entry* entries;
+  u32 nEntries;
+  u32 i;
+
+  spin_lock_irq(&mdev->dmaLock);
+  stream->running = false;
+  spin_unlock_irq(&mdev->dmaLock);
+
+  hrtimer_cancel(&stream->timer);
+
+  // the device must be done with the buffer before it goes back to the buffer list
+  wait_event_timeout(stream->wait, !READ_ONCE(stream->filling), nsecs_to_jiffies(stream->timeoutNs));
+
+  spin_lock_irq(&mdev->dmaLock);
+  if(stream->filling) {
+    pcieuni_dma_cancel_locked(mdev, stream->entries[stream->fillSeq % stream->nEntries].buffer);
+    stream->filling = false;
+  }
+  entries = stream->entries;
+  nEntries = stream->nEntries;
+  stream->owner = 0;
+  stream->entries = 0;
+  stream->nEntries = 0;
+  spin_unlock_irq(&mdev->dmaLock);
+
+  // wake up PCIEUNI_STREAM_NEXT waiting for data
+  wake_up(&stream->wait);
+
+  for(i = 0; i < nEntries; i++) {
+    pcieuni_bufferList_set_free(&mdev->dmaBuffers, entries[i].buffer);
+    pcieuni_dma_unhold_buffer(mdev);
+  }
+  kfree(entries);
+}
+
+/**
+ * @brief Initializes the streaming part of the driver device structure
+ *
+ * @param mdev  Target device
+ */
+void pcieuni_dma_stream_init(module_dev* mdev) {
+  pcieuni_dma_stream* stream = &mdev->stream;
+
+  mutex_init(&stream->mutex);
+  init_waitqueue_head(&stream->wait);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+  hrtimer_setup(&stream->timer, pcieuni_dma_stream_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+#else
+  hrtimer_init(&stream->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+  stream->timer.function = pcieuni_dma_stream_timer;
+#endif
+  stream->owner = 0;
+  stream->running = false;
+  stream->entries = 0;
+  stream->nEntries = 0;
+}
+
+/**
+ * @brief Stops the stream of the board, if any
+ * @note This function may block.
+ *
+ * @param mdev  Target device
+ */
+void pcieuni_dma_stream_cleanup(module_dev* mdev) {
+  mutex_lock(&mdev->stream.mutex);
+  if(mdev->stream.owner) pcieuni_dma_stream_shutdown(mdev);
+  mutex_unlock(&mdev->stream.mutex);
+}
+
+/**
+ * @brief Starts the streaming acquisition of the board
+ *
+ * The stream holds its slots until it is stopped, at least one buffer is always left for the regular DMA read. The
+ * first read is queued right away.
+ * @note This function may block.
+ *
+ * @param mdev    Target device
+ * @param filp    File owning the stream
+ * @param config  Stream configuration, returns the number of slots used
+ *
+ * @retval 0             Success
+ * @retval -EINVAL       Invalid size or period or the data does not fit into a slot
+ * @retval -EBUSY        A stream is already running or not enough buffers can be held
+ * @retval -EFAULT       The DMA registers are not mapped
+ * @retval -ENOMEM       Failed to allocate memory
+ * @retval -ERESTARTSYS  Interrupted while waiting for the stream lock
+ */
+int pcieuni_dma_stream_start(module_dev* mdev, struct file* filp, pcieuni_stream_config* config) {
+  int retVal = 0;
+  pcieuni_dma_stream* stream = &mdev->stream;
+  pcieuni_stream_entry* entries;
+  unsigned long dmaSize = PCIEUNI_DMA_SYZE * DIV_ROUND_UP((unsigned long)config->dma_size, PCIEUNI_DMA_SYZE);
+  u64 periodNs = (u64)config->period_us * NSEC_PER_USEC;
+  u32 nEntries = config->slots;
+  u32 nHeld;
+
+  PDEBUG(mdev->parent_dev->name, "pcieuni_dma_stream_start(offset=0x%x, size=0x%x, period=%uus, slots=%u)",
+      config->dma_offset, config->dma_size, config->period_us, config->slots);
+
+  if(!mdev->parent_dev->memmory_base2) return -EFAULT;
+  if(!config->dma_size) return -EINVAL;
+  if(config->period_us && config->period_us < PCIEUNI_STREAM_MIN_PERIOD_US) return -EINVAL;
+
+  if(mutex_lock_interruptible(&stream->mutex)) return -ERESTARTSYS;
+
+  if(stream->owner) {
+    retVal = -EBUSY;
+    goto cleanup_mutex;
+  }
+
+  // pcieuni_dma_hold_buffer() leaves one buffer for the regular DMA read
+  if(!nEntries) nEntries = max(mdev->dmaSlotCount - 1, 0);
+  if(!nEntries) {
+    retVal = -EBUSY;
+    goto cleanup_mutex;
+  }
+
+  entries = kcalloc(nEntries, sizeof(pcieuni_stream_entry), GFP_KERNEL);
+  if(!entries) {
+    retVal = -ENOMEM;
+    goto cleanup_mutex;
+  }
+
+  for(nHeld = 0; nHeld < nEntries; nHeld++) {
+    retVal = pcieuni_dma_hold_buffer(mdev);
+    if(retVal) goto cleanup_buffers;
+
+    entries[nHeld].buffer = pcieuni_bufferList_get_free(&mdev->dmaBuffers);
+    if(IS_ERR(entries[nHeld].buffer)) {
+      retVal = PTR_ERR(entries[nHeld].buffer);
+      pcieuni_dma_unhold_buffer(mdev);
+      goto cleanup_buffers;
+    }
+    entries[nHeld].slot = pcieuni_dma_ring_slot(mdev, entries[nHeld].buffer);
+  }
+
+  // the held buffers keep the pool from being replaced, so their size can be checked now
+  if(dmaSize > entries[0].buffer->size) {
+    retVal = -EINVAL;
+    goto cleanup_buffers;
+  }
+
+  spin_lock_irq(&mdev->dmaLock);
+  stream->owner = filp;
+  stream->entries = entries;
+  stream->nEntries = nEntries;
+  stream->devOffset = config->dma_offset;
+  stream->dmaSize = dmaSize;
+  stream->periodNs = periodNs;
+  stream->timeoutNs = pcieuni_dma_timeout_ns(mdev, dmaSize);
+  stream->fillSeq = 0;
+  stream->readSeq = 0;
+  stream->doneSeq = 0;
+  stream->filling = false;
+  stream->stalled = false;
+  stream->overruns = 0;
+  stream->running = true;
+  pcieuni_dma_stream_arm(mdev);
+  spin_unlock_irq(&mdev->dmaLock);
+
+  hrtimer_start(&stream->timer, pcieuni_dma_stream_interval(stream), HRTIMER_MODE_REL_SOFT);
+
+  config->slots = nEntries;
+  mutex_unlock(&stream->mutex);
+  return 0;
+
+cleanup_buffers:
+  while(nHeld--) {
+    pcieuni_bufferList_set_free(&mdev->dmaBuffers, entries[nHeld].buffer);
+    pcieuni_dma_unhold_buffer(mdev);
+  }
+  kfree(entries);
+
+cleanup_mutex:
+  mutex_unlock(&stream->mutex);
+  return retVal;
+}
+
+/**
+ * @brief Stops the streaming acquisition of the board
+ *
+ * Slots taken with pcieuni_dma_stream_next() and not released yet are no longer valid.
+ * @note This function may block.
+ *
+ * @param mdev  Target device
+ * @param filp  File owning the stream
+ *
+ * @retval 0        Success
+ * @retval -EINVAL  The file does not own the stream
+ */
+int pcieuni_dma_stream_stop(module_dev* mdev, struct file* filp) {
+  int retVal = 0;
+
+  mutex_lock(&mdev->stream.mutex);
+  if(mdev->stream.owner == filp) {
+    pcieuni_dma_stream_shutdown(mdev);
+  }
+  else {
+    retVal = -EINVAL;
+  }
+  mutex_unlock(&mdev->stream.mutex);
+
+  return retVal;
+}
+
+/**
+ * @brief Stops the stream of a file being closed
+ * @note This function may block.
+ *
+ * @param mdev  Target device
+ * @param filp  File being closed
+ */
+void pcieuni_dma_stream_release_file(module_dev* mdev, struct file* filp) {
+  mutex_lock(&mdev->stream.mutex);
+  if(mdev->stream.owner == filp) pcieuni_dma_stream_shutdown(mdev);
+  mutex_unlock(&mdev->stream.mutex);
+}
+
+/**
+ * @brief Checks whether PCIEUNI_STREAM_NEXT of a file would not block
+ *
+ * @param stream  Stream of the board
+ * @param filp    Calling file
+ *
+ * @return true if a filled slot is waiting or the file does not own the stream
+ */
+static bool pcieuni_dma_stream_ready(pcieuni_dma_stream* stream, struct file* filp) {
+  return READ_ONCE(stream->owner) != filp || READ_ONCE(stream->readSeq) != READ_ONCE(stream->fillSeq);
+}
+
+/**
+ * @brief Takes the oldest filled slot of the stream
+ *
+ * Waits for the next read to finish unless the file is non-blocking. The slot is synced for CPU access.
+ * @note This function may block.
+ *
+ * @param mdev  Target device
+ * @param filp  File owning the stream
+ * @param slot  Returns the slot
+ *
+ * @retval 0             Success
+ * @retval -EINVAL       The file does not own the stream
+ * @retval -EAGAIN       No filled slot and the file is non-blocking
+ * @retval -ERESTARTSYS  Interrupted while waiting
+ */
+int pcieuni_dma_stream_next(module_dev* mdev, struct file* filp, pcieuni_stream_slot* slot) {
+  pcieuni_dma_stream* stream = &mdev->stream;
+  pcieuni_stream_entry* entry;
+  pcieuni_buffer* buffer;
+
+  for(;;) {
+    spin_lock_irq(&mdev->dmaLock);
+    if(stream->owner != filp) {
+      spin_unlock_irq(&mdev->dmaLock);
+      return -EINVAL;
+    }
+    if(stream->readSeq != stream->fillSeq) break;
+    spin_unlock_irq(&mdev->dmaLock);
+
+    if(filp->f_flags & O_NONBLOCK) return -EAGAIN;
+    if(wait_event_interruptible(stream->wait, pcieuni_dma_stream_ready(stream, filp))) return -ERESTARTSYS;
+  }
+
+  entry = &stream->entries[stream->readSeq % stream->nEntries];
+  stream->readSeq++;
+  buffer = entry->buffer;
+  slot->slot = entry->slot;
+  slot->dma_size = stream->dmaSize;
+  slot->slot_offset = (u64)entry->slot * mdev->dmaSlotSize;
+  slot->seq = entry->seq;
+  slot->timestamp_ns = entry->doneNs;
+  slot->overruns = stream->overruns;
+  spin_unlock_irq(&mdev->dmaLock);
+
+  pcieuni_dma_sync_chunk(mdev, buffer, -1, false);
+  return 0;
+}
+
+/**
+ * @brief Hands the oldest slot taken with pcieuni_dma_stream_next() back to the stream
+ *
+ * @param mdev  Target device
+ * @param filp  File owning the stream
+ *
+ * @retval 0        Success
+ * @retval -EINVAL  The file does not own the stream or holds no slot
+ */
+int pcieuni_dma_stream_release(module_dev* mdev, struct file* filp) {
+  int retVal = 0;
+  pcieuni_dma_stream* stream = &mdev->stream;
+
+  spin_lock_irq(&mdev->dmaLock);
+  if(stream->owner != filp || stream->doneSeq == stream->readSeq) {
+    retVal = -EINVAL;
+  }
+  else {
+    stream->doneSeq++;
+    if(stream->stalled) pcieuni_dma_stream_arm(mdev);
+  }
+  spin_unlock_irq(&mdev->dmaLock);
+
+  return retVal;
+}
+
+/**
+ * @brief Poll handler - device file is readable while the stream of the file has a filled slot
+ *
+ * @param mdev  Target device
+ * @param filp  Polled file
+ * @param wait  Poll table
+ *
+ * @return Poll mask
+ */
+__poll_t pcieuni_dma_stream_poll(module_dev* mdev, struct file* filp, struct poll_table_struct* wait) {
+  __poll_t mask = 0;
+  pcieuni_dma_stream* stream = &mdev->stream;
+
+  poll_wait(filp, &stream->wait, wait);
+
+  spin_lock_irq(&mdev->dmaLock);
+  if(stream->owner == filp && stream->readSeq != stream->fillSeq) mask |= EPOLLIN | EPOLLRDNORM;
+  spin_unlock_irq(&mdev->dmaLock);
+
+  return mask;
+}
@@ -0,0 +1,161 @@
+/**
+ *  @file   pcieuni_dma_trigger.c
+ *  @brief  DMA read started by the trigger interrupt of the board
+ *
+ *  A process arms a DMA read and sleeps. The next device event (see pcieuni_events.c), i.e. an interrupt that is not
+ *  an end of DMA interrupt, starts all armed reads right from the top-half interrupt handler, and the process is only
+ *  woken up by the end of DMA interrupt. There is no round trip through user space between trigger and DMA start.
+ *  The trigger arrives while other reads are running, so it needs the DMA status register to be told apart from their
+ *  end of DMA interrupts.
+ */
+
+#include "pcieuni_fnc.h"
+#include "pcieuni_trace.h"
+#include <gpcieuni/pcieuni_buffer.h>
+#include <linux/dma-mapping.h>
+#include <linux/uaccess.h>
+
+/**
+ * @brief DMA read waiting for the trigger
+ *
+ * Lives on the stack of the waiting process. Unless noted otherwise the members are protected by module_dev::dmaLock.
+ */
+struct pcieuni_dma_trigger {
+  struct list_head list;  /**< Entry in module_dev::triggerArmed */
+  pcieuni_dma_xfer xfer;  /**< Queue entry of the read */
+  pcieuni_buffer* buffer; /**< Target DMA buffer */
+  bool started;           /**< The trigger came and the read was queued */
+  int status;             /**< Result of queueing the read */
+  u64 triggerNs;          /**< Time of the trigger interrupt (ktime_get_ns()) */
+};
+typedef struct pcieuni_dma_trigger pcieuni_dma_trigger;
+
+/**
+ * @brief Starts all armed DMA reads
+ * @note Called from the top-half interrupt handler with module_dev::dmaLock held.
+ *
+ * @param mdev   Target device
+ * @param irqNs  Time of the trigger interrupt (ktime_get_ns())
+ */
+void pcieuni_dma_trigger_fire(module_dev* mdev, u64 irqNs) {
+  pcieuni_dma_trigger* req;
+
+  while((req = list_first_entry_or_null(&mdev->triggerArmed, pcieuni_dma_trigger, list))) {
+    list_del_init(&req->list);
+    req->started = true;
+    req->triggerNs = irqNs;
+    req->status = pcieuni_dma_queue_locked(mdev, req->buffer, &req->xfer);
+    if(req->status) {
+      // no end of DMA interrupt will come, let the waiting process see the error
+      clear_bit(BUFFER_STATE_WAITING, &req->buffer->state);
+      complete_all(&req->xfer.finished);
+    }
+  }
+}
+
+/**
+ * @brief Arms a DMA read for the next trigger and waits until its data is copied to user space
+ *
+ * The read uses one driver buffer, which is held from arming until the data is copied, so its size is limited to the
+ * size of a DMA buffer. Several processes may arm reads for the same trigger, they are then started one after
+ * another.
+ * @note This function may block.
+ *
+ * @param dev         Target device
+ * @param devOffset   DMA offset to read from
+ * @param dataSize    Size of data to be read
+ * @param userBuffer  Target user-space buffer
+ * @param timeoutMs   Time to wait for the trigger in ms, 0 to wait without limit
+ * @param triggerNs   Returns the time of the trigger interrupt (ktime_get_ns())
+ * @param irqNs       Returns the time of the end of DMA interrupt (ktime_get_ns())
+ *
+ * @retval 0           Success
+ * @retval -EOPNOTSUPP The board has no interrupt vector of its own or no DMA status register (see
+ *                     pcieuni_dma_status_available()), so a trigger can not be recognized
+ * @retval -EINVAL     Data does not fit into a driver buffer
+ * @retval -EBUSY      Too many DMA buffers are held or the buffers are being replaced
+ * @retval -ETIMEDOUT  No trigger within the timeout
+ * @retval -EINTR      Interrupted while waiting for the trigger
+ * @retval -EFAULT     DMA registers are not mapped or failed to copy data to user space
+ * @retval -EIO        Failed to write to device registers or timed out while waiting for end of DMA IRQ
+ * @retval -ENODEV     The board is being removed
+ */
+int pcieuni_dma_read_triggered(pcieuni_dev* dev, unsigned long devOffset, unsigned long dataSize,
+    void __user* userBuffer, u32 timeoutMs, u64* triggerNs, u64* irqNs) {
+  int retVal = 0;
+  long remaining;
+  bool started;
+  unsigned long dmaSize = PCIEUNI_DMA_SYZE * DIV_ROUND_UP(dataSize, PCIEUNI_DMA_SYZE);
+  pcieuni_dma_trigger req = {};
+  struct module_dev* mdev = pcieuni_get_mdev(dev);
+
+  PDEBUG(dev->name, "pcieuni_dma_read_triggered(devOffset=0x%lx, dataSize=0x%lx)\n", devOffset, dataSize);
+
+  if(!dev->memmory_base2) return -EFAULT;
+  if(!mdev->irqExclusive || !pcieuni_dma_status_available(mdev)) return -EOPNOTSUPP;
+  if(!dataSize) return -EINVAL;
+
+  // a held buffer also keeps the buffers from being replaced while their size is checked
+  retVal = pcieuni_dma_hold_buffer(mdev);
+  if(retVal) return retVal;
+
+  if(dmaSize > mdev->dmaSlots[0].buffer->size) {
+    retVal = -EINVAL;
+    goto cleanup_hold;
+  }
+
+  req.buffer = pcieuni_bufferList_get_free(&mdev->dmaBuffers);
+  if(IS_ERR(req.buffer)) {
+    retVal = PTR_ERR(req.buffer);
+    goto cleanup_hold;
+  }
+
+  req.buffer->dma_offset = devOffset;
+  req.buffer->dma_size = dmaSize;
+  pcieuni_dma_sync_chunk(mdev, req.buffer, -1, true);
+  set_bit(BUFFER_STATE_WAITING, &req.buffer->state);
+  req.xfer.toDevice = false;
+  req.xfer.done = 0;
+  init_completion(&req.xfer.finished);
+  INIT_LIST_HEAD(&req.list);
+
+  spin_lock_irq(&mdev->dmaLock);
+  list_add_tail(&req.list, &mdev->triggerArmed);
+  spin_unlock_irq(&mdev->dmaLock);
+
+  // the end of DMA interrupt wakes us up, the trigger itself does not
+  remaining = wait_for_completion_interruptible_timeout(
+      &req.xfer.finished, timeoutMs ? msecs_to_jiffies(timeoutMs) : MAX_SCHEDULE_TIMEOUT);
+
+  spin_lock_irq(&mdev->dmaLock);
+  started = req.started;
+  if(!started) list_del_init(&req.list);
+  spin_unlock_irq(&mdev->dmaLock);
+
+  if(!started) {
+    retVal = remaining < 0 ? -EINTR : -ETIMEDOUT;
+    goto cleanup_buffer;
+  }
+
+  // the trigger came, the read may still be running
+  retVal = req.status;
+  if(!retVal) retVal = pcieuni_wait_dma_read(mdev, &req.xfer);
+  pcieuni_dma_sync_chunk(mdev, req.buffer, -1, false);
+  if(retVal) goto cleanup_buffer;
+
+  if(copy_to_user(userBuffer, (void*)req.buffer->kaddr, dataSize)) {
+    retVal = -EFAULT;
+    goto cleanup_buffer;
+  }
+  trace_pcieuni_dma_copy(mdev->brd_num, req.buffer, req.buffer->dma_offset, req.buffer->dma_size);
+
+  *triggerNs = req.triggerNs;
+  *irqNs = req.xfer.doneNs;
+
+cleanup_buffer:
+  pcieuni_bufferList_set_free(&mdev->dmaBuffers, req.buffer);
+
+cleanup_hold:
+  pcieuni_dma_unhold_buffer(mdev);
+  return retVal;
+}
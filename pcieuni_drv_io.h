@@ -0,0 +1,264 @@
+/**
+ *  @file   pcieuni_drv_io.h
+ *  @brief  Driver specific IOCTL definitions shared with user space
+ *
+ *  Extends the IOCTL interface of the universal driver (gpcieuni/pcieuni_io.h) with requests that are
+ *  implemented only by the pcieuni driver. All commands use the PCIEUNI_IOC type and are dispatched to
+ *  ::pcieuni_ioctl_dma(). Reserved fields must be 0, otherwise the request fails with EINVAL.
+ */
+
+#ifndef _PCIEUNI_DRV_IO_H_
+#define _PCIEUNI_DRV_IO_H_
+
+#include <gpcieuni/pcieuni_io.h>
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/**
+ * @brief Description of the mmap-able DMA ring
+ *
+ * The ring is mapped read-only with mmap() on the device file at offset 0. Slot n starts at byte offset
+ * n * slot_size of the mapping.
+ */
+struct pcieuni_ring_info {
+  __u32 slot_count; /**< Number of slots in the ring */
+  __u32 slot_size;  /**< Size of one slot in bytes (multiple of the page size) */
+};
+typedef struct pcieuni_ring_info pcieuni_ring_info;
+
+/**
+ * @brief DMA read into a slot of the mmap-able DMA ring
+ */
+struct pcieuni_ring_dma {
+  __u32 dma_offset;  /**< [in]  Device offset to read from */
+  __u32 dma_size;    /**< [in]  Size of data to read, at most pcieuni_ring_info::slot_size */
+  __u32 slot;        /**< [out] Index of the ring slot holding the data */
+  __u32 reserved;    /**< Must be 0 */
+  __u64 slot_offset; /**< [out] Byte offset of the slot in the mapping */
+};
+typedef struct pcieuni_ring_dma pcieuni_ring_dma;
+
+/**
+ * @brief Submission of an asynchronous DMA read
+ */
+struct pcieuni_dma_async {
+  __u32 dma_offset; /**< [in]  Device offset to read from */
+  __u32 dma_size;   /**< [in]  Size of data to read, at most pcieuni_ring_info::slot_size */
+  __u32 id;         /**< [out] Request id, reported again by PCIEUNI_DMA_COLLECT */
+  __u32 reserved;   /**< Must be 0 */
+};
+typedef struct pcieuni_dma_async pcieuni_dma_async;
+
+/**
+ * @brief Result of a finished asynchronous DMA read
+ */
+struct pcieuni_dma_result {
+  __u64 data;     /**< [in]  User-space address the data is copied to (at least dma_size bytes) */
+  __u32 id;       /**< [out] Id of the finished request */
+  __s32 status;   /**< [out] 0 on success or negative error code of the DMA read */
+  __u32 dma_size; /**< [out] Size of data copied to data */
+  __u32 reserved; /**< Must be 0 */
+};
+typedef struct pcieuni_dma_result pcieuni_dma_result;
+
+/**
+ * @brief DMA write from user space to board memory
+ */
+struct pcieuni_write_dma {
+  __u64 data;       /**< [in]  User-space address of the data (at least dma_size bytes) */
+  __u32 dma_offset; /**< [in]  Device offset to write to */
+  __u32 dma_size;   /**< [in]  Size of data to write */
+};
+typedef struct pcieuni_write_dma pcieuni_write_dma;
+
+/**
+ * @brief Timestamps of a DMA read, all in ns of CLOCK_MONOTONIC
+ */
+struct pcieuni_dma_timestamps {
+  __u64 submit_ns; /**< Read entered the driver */
+  __u64 start_ns;  /**< First DMA transfer of the read started on the DMA engine */
+  __u64 irq_ns;    /**< End of DMA interrupt of the last DMA transfer */
+  __u64 copy_ns;   /**< Last data copied to the user buffer (zero-copy read: completion seen by the reader) */
+};
+typedef struct pcieuni_dma_timestamps pcieuni_dma_timestamps;
+
+/**
+ * @brief DMA read returning the timestamps of the read with the data
+ */
+struct pcieuni_read_dma_ts {
+  __u64 data;                /**< [in]  User-space address the data is copied to (at least dma_size bytes) */
+  __u32 dma_offset;          /**< [in]  Device offset to read from */
+  __u32 dma_size;            /**< [in]  Size of data to read */
+  pcieuni_dma_timestamps ts; /**< [out] Timestamps of the read */
+};
+typedef struct pcieuni_read_dma_ts pcieuni_read_dma_ts;
+
+/**
+ * @brief Maximum number of regions in one scatter/gather DMA read
+ */
+#define PCIEUNI_DMA_SG_MAX 1024
+
+/**
+ * @brief Region of a scatter/gather DMA read
+ */
+struct pcieuni_dma_sg_entry {
+  __u64 data;       /**< [in] User-space address the data is copied to (at least dma_size bytes) */
+  __u32 dma_offset; /**< [in] Device offset to read from */
+  __u32 dma_size;   /**< [in] Size of data to read */
+};
+typedef struct pcieuni_dma_sg_entry pcieuni_dma_sg_entry;
+
+/**
+ * @brief Scatter/gather DMA read of several board memory regions in one call
+ */
+struct pcieuni_dma_sg {
+  __u64 entries;  /**< [in] User-space address of a vector of count pcieuni_dma_sg_entry */
+  __u32 count;    /**< [in] Number of regions, at most PCIEUNI_DMA_SG_MAX */
+  __u32 reserved; /**< Must be 0 */
+};
+typedef struct pcieuni_dma_sg pcieuni_dma_sg;
+
+/**
+ * @brief mmap() offsets of the BARs
+ *
+ * mmap() on the device file at PCIEUNI_MMAP_BAR(bar) + offset maps the BAR uncached starting at the page-aligned
+ * offset inside the BAR, PCIEUNI_MMAP_BAR_WC(bar) + offset maps it write-combining. Write-combining is meant for
+ * regions receiving bulk data; stores may be merged and reordered, so it must not be used for control registers.
+ * Offsets below PCIEUNI_MMAP_BAR(0) map the DMA ring.
+ */
+#define PCIEUNI_MMAP_BAR_SHIFT 36
+#define PCIEUNI_MMAP_WC ((__u64)1 << 35)
+#define PCIEUNI_MMAP_BAR(bar) (((__u64)(bar) + 1) << PCIEUNI_MMAP_BAR_SHIFT)
+#define PCIEUNI_MMAP_BAR_WC(bar) (PCIEUNI_MMAP_BAR(bar) | PCIEUNI_MMAP_WC)
+
+/**
+ * @brief Register operation codes for pcieuni_reg_op::cmd
+ */
+#define PCIEUNI_REG_READ 0  /**< Read register into value */
+#define PCIEUNI_REG_WRITE 1 /**< Write value to register */
+#define PCIEUNI_REG_RMW 2   /**< Replace the bits of mask by those of value, return the previous register value */
+
+/**
+ * @brief Maximum number of operations in one register batch
+ */
+#define PCIEUNI_REG_BATCH_MAX 4096
+
+/**
+ * @brief One register operation of a batch
+ */
+struct pcieuni_reg_op {
+  __u32 offset;  /**< [in]     Register offset in the BAR, aligned to the access width */
+  __u32 value;   /**< [in,out] Value to write, value read by PCIEUNI_REG_READ and PCIEUNI_REG_RMW */
+  __u32 mask;    /**< [in]     Bits changed by PCIEUNI_REG_RMW */
+  __u8 bar;      /**< [in]     BAR number (0 - 5) */
+  __u8 mode;     /**< [in]     Access width RW_D8, RW_D16 or RW_D32 */
+  __u8 cmd;      /**< [in]     PCIEUNI_REG_READ, PCIEUNI_REG_WRITE or PCIEUNI_REG_RMW */
+  __u8 reserved; /**< Must be 0 */
+};
+typedef struct pcieuni_reg_op pcieuni_reg_op;
+
+/**
+ * @brief Batch of register operations executed in order under one device lock
+ */
+struct pcieuni_reg_batch {
+  __u64 ops;      /**< [in] User-space address of a vector of count pcieuni_reg_op */
+  __u32 count;    /**< [in] Number of operations, at most PCIEUNI_REG_BATCH_MAX */
+  __u32 reserved; /**< Must be 0 */
+};
+typedef struct pcieuni_reg_batch pcieuni_reg_batch;
+
+/**
+ * @brief Subscription to device interrupts which are not end of DMA interrupts (PCIEUNI_EVENT_SUBSCRIBE)
+ *
+ * After subscribing, poll() on the device file reports POLLPRI while there are events not yet read with
+ * PCIEUNI_EVENT_READ. Subscribing fails with EOPNOTSUPP unless the board uses an MSI or MSI-X interrupt and the DMA
+ * status register is configured (module parameter dma_status_reg); without it an event arriving during a DMA read
+ * would be taken as the end of that read.
+ */
+struct pcieuni_event_subscribe {
+  __s32 eventfd;  /**< [in] eventfd signalled on every event, -1 to use poll() only */
+  __u32 reserved; /**< Must be 0 */
+};
+typedef struct pcieuni_event_subscribe pcieuni_event_subscribe;
+
+/**
+ * @brief Event state of the board returned by PCIEUNI_EVENT_READ
+ */
+struct pcieuni_event {
+  __u64 count;        /**< [out] Number of events of the board since the driver was loaded */
+  __u64 timestamp_ns; /**< [out] Time of the last event (CLOCK_MONOTONIC) */
+  __u64 pending;      /**< [out] Number of events since the previous PCIEUNI_EVENT_READ of this file */
+};
+typedef struct pcieuni_event pcieuni_event;
+
+/**
+ * @brief Shortest period of the streaming acquisition in us
+ */
+#define PCIEUNI_STREAM_MIN_PERIOD_US 100
+
+/**
+ * @brief Configuration of the streaming acquisition (PCIEUNI_STREAM_START)
+ *
+ * The driver keeps reading the same device region into slots of the DMA ring, back to back or with a fixed period.
+ * Reads that are due while no slot is free are skipped and counted as overruns.
+ */
+struct pcieuni_stream_config {
+  __u32 dma_offset; /**< [in]     Device offset to read from */
+  __u32 dma_size;   /**< [in]     Size of each read, at most the size of a ring slot */
+  __u32 period_us;  /**< [in]     Period of the reads, 0 for back to back or at least PCIEUNI_STREAM_MIN_PERIOD_US */
+  __u32 slots;      /**< [in,out] Number of ring slots filled by the stream, 0 for as many as possible */
+};
+typedef struct pcieuni_stream_config pcieuni_stream_config;
+
+/**
+ * @brief Oldest filled slot of the streaming acquisition returned by PCIEUNI_STREAM_NEXT
+ *
+ * The slot stays with the process until it is handed back with PCIEUNI_STREAM_RELEASE. Slots are handed back in the
+ * order they were returned.
+ */
+struct pcieuni_stream_slot {
+  __u32 slot;         /**< [out] Index of the DMA ring slot holding the data */
+  __u32 dma_size;     /**< [out] Size of the data */
+  __u64 slot_offset;  /**< [out] Offset of the slot in the mapping of the DMA ring */
+  __u64 seq;          /**< [out] Sequence number of the read, counting from 0 */
+  __u64 timestamp_ns; /**< [out] Time of the end of DMA interrupt of the read (CLOCK_MONOTONIC) */
+  __u64 overruns;     /**< [out] Number of reads skipped since the stream was started */
+};
+typedef struct pcieuni_stream_slot pcieuni_stream_slot;
+
+/**
+ * @brief DMA read started by the next trigger interrupt of the board (PCIEUNI_READ_DMA_TRIGGERED)
+ *
+ * The ioctl() returns when the data is copied. Fails with EOPNOTSUPP unless the board uses an MSI or MSI-X interrupt
+ * and the DMA status register is configured (module parameter dma_status_reg), see PCIEUNI_EVENT_SUBSCRIBE.
+ */
+struct pcieuni_read_dma_trigger {
+  __u64 data;       /**< [in]  User-space address the data is copied to (at least dma_size bytes) */
+  __u32 dma_offset; /**< [in]  Device offset to read from */
+  __u32 dma_size;   /**< [in]  Size of data to read, at most the size of a DMA buffer */
+  __u32 timeout_ms; /**< [in]  Time to wait for the trigger, 0 to wait without limit */
+  __u32 reserved;   /**< Must be 0 */
+  __u64 trigger_ns; /**< [out] Time of the trigger interrupt (CLOCK_MONOTONIC) */
+  __u64 irq_ns;     /**< [out] Time of the end of DMA interrupt (CLOCK_MONOTONIC) */
+};
+typedef struct pcieuni_read_dma_trigger pcieuni_read_dma_trigger;
+
+#define PCIEUNI_RING_INFO _IOR(PCIEUNI_IOC, 80, pcieuni_ring_info)
+#define PCIEUNI_RING_READ_DMA _IOWR(PCIEUNI_IOC, 81, pcieuni_ring_dma)
+#define PCIEUNI_RING_RELEASE _IOW(PCIEUNI_IOC, 82, __u32)
+#define PCIEUNI_DMA_SUBMIT _IOWR(PCIEUNI_IOC, 83, pcieuni_dma_async)
+#define PCIEUNI_DMA_COLLECT _IOWR(PCIEUNI_IOC, 84, pcieuni_dma_result)
+#define PCIEUNI_DMA_WRITE _IOW(PCIEUNI_IOC, 85, pcieuni_write_dma)
+#define PCIEUNI_REG_BATCH _IOW(PCIEUNI_IOC, 86, pcieuni_reg_batch)
+#define PCIEUNI_READ_DMA_SG _IOW(PCIEUNI_IOC, 87, pcieuni_dma_sg)
+#define PCIEUNI_READ_DMA_TS _IOWR(PCIEUNI_IOC, 88, pcieuni_read_dma_ts)
+#define PCIEUNI_EVENT_SUBSCRIBE _IOW(PCIEUNI_IOC, 89, pcieuni_event_subscribe)
+#define PCIEUNI_EVENT_UNSUBSCRIBE _IO(PCIEUNI_IOC, 90)
+#define PCIEUNI_EVENT_READ _IOR(PCIEUNI_IOC, 91, pcieuni_event)
+#define PCIEUNI_STREAM_START _IOWR(PCIEUNI_IOC, 92, pcieuni_stream_config)
+#define PCIEUNI_STREAM_STOP _IO(PCIEUNI_IOC, 93)
+#define PCIEUNI_STREAM_NEXT _IOR(PCIEUNI_IOC, 94, pcieuni_stream_slot)
+#define PCIEUNI_STREAM_RELEASE _IO(PCIEUNI_IOC, 95)
+#define PCIEUNI_READ_DMA_TRIGGERED _IOWR(PCIEUNI_IOC, 96, pcieuni_read_dma_trigger)
+
+#endif /* _PCIEUNI_DRV_IO_H_ */
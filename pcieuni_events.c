@@ -0,0 +1,256 @@
+/**
+ *  @file   pcieuni_events.c
+ *  @brief  Notification of device interrupts that are not end of DMA interrupts
+ *
+ *  Every interrupt of the board that does not finish a DMA transfer is an event. Events are counted and time stamped
+ *  per board. A file subscribes to the events with an ioctl(), then poll() on the device file reports EPOLLPRI while
+ *  there are events the file did not read yet, and an optional eventfd is signalled on every event.
+ *
+ *  On a shared legacy interrupt line an interrupt can not be told apart from the interrupts of other devices, so
+ *  events are only recorded if the board has an MSI or MSI-X vector of its own. An interrupt arriving while a DMA read
+ *  is running can only be told apart from its end of DMA interrupt with the DMA status register, so subscribing needs
+ *  it as well.
+ */
+
+#include "pcieuni_fnc.h"
+#include <linux/eventfd.h>
+#include <linux/poll.h>
+#include <linux/slab.h>
+#include <linux/version.h>
+
+/**
+ * @brief Subscription of a file to the device events
+ */
+struct pcieuni_event_sub {
+  struct list_head list;       /**< Entry in module_dev::eventSubs */
+  struct file* owner;          /**< Subscribed file */
+  u64 seen;                    /**< Event count at the last PCIEUNI_EVENT_READ of the file */
+  struct eventfd_ctx* eventfd; /**< eventfd signalled on every event or NULL */
+};
+typedef struct pcieuni_event_sub pcieuni_event_sub;
+
+/**
+ * @brief Returns the subscription of a file
+ * @note Called with module_dev::eventLock held.
+ *
+ * @param mdev  Target device
+ * @param filp  Subscribed file
+ *
+ * @return Subscription or NULL if the file is not subscribed
+ */
+static pcieuni_event_sub* pcieuni_events_find(module_dev* mdev, struct file* filp) {
+  pcieuni_event_sub* sub;
+
+  list_for_each_entry(sub, &mdev->eventSubs, list) {
+    if(sub->owner == filp) return sub;
+  }
+  return 0;
+}
+
+/**
+ * @brief Frees a subscription that is no longer in the subscription list
+ *
+ * @param sub  Subscription
+ */
+static void pcieuni_events_free(pcieuni_event_sub* sub) {
+  if(sub->eventfd) eventfd_ctx_put(sub->eventfd);
+  kfree(sub);
+}
+
+/**
+ * @brief Initializes the event part of the driver device structure
+ *
+ * @param mdev  Target device
+ */
+void pcieuni_events_init(module_dev* mdev) {
+  INIT_LIST_HEAD(&mdev->eventSubs);
+  spin_lock_init(&mdev->eventLock);
+  init_waitqueue_head(&mdev->eventWait);
+  mdev->eventCount = 0;
+  mdev->eventNs = 0;
+  mdev->eventPending = false;
+}
+
+/**
+ * @brief Drops all subscriptions
+ *
+ * @param mdev  Target device
+ */
+void pcieuni_events_cleanup(module_dev* mdev) {
+  pcieuni_event_sub* sub;
+  pcieuni_event_sub* tmp;
+  LIST_HEAD(dropped);
+  unsigned long flags;
+
+  spin_lock_irqsave(&mdev->eventLock, flags);
+  list_splice_init(&mdev->eventSubs, &dropped);
+  spin_unlock_irqrestore(&mdev->eventLock, flags);
+
+  list_for_each_entry_safe(sub, tmp, &dropped, list) {
+    list_del(&sub->list);
+    pcieuni_events_free(sub);
+  }
+}
+
+/**
+ * @brief Records a device event
+ * @note Called from the top-half interrupt handler, so it must not block.
+ *
+ * @param mdev   Target device
+ * @param irqNs  Time of the interrupt (ktime_get_ns())
+ */
+void pcieuni_events_record(module_dev* mdev, u64 irqNs) {
+  spin_lock(&mdev->eventLock);
+  mdev->eventCount++;
+  mdev->eventNs = irqNs;
+  mdev->eventPending = true;
+  spin_unlock(&mdev->eventLock);
+}
+
+/**
+ * @brief Notifies the subscribers of recorded events
+ *
+ * Events recorded while the interrupt thread did not run yet are signalled once, the event count tells how many.
+ * @note Called from the threaded interrupt handler.
+ *
+ * @param mdev  Target device
+ */
+void pcieuni_events_notify(module_dev* mdev) {
+  pcieuni_event_sub* sub;
+
+  spin_lock_irq(&mdev->eventLock);
+  if(!mdev->eventPending) {
+    spin_unlock_irq(&mdev->eventLock);
+    return;
+  }
+  mdev->eventPending = false;
+  list_for_each_entry(sub, &mdev->eventSubs, list) {
+    if(!sub->eventfd) continue;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+    eventfd_signal(sub->eventfd);
+#else
+    eventfd_signal(sub->eventfd, 1);
+#endif
+  }
+  spin_unlock_irq(&mdev->eventLock);
+
+  wake_up_interruptible(&mdev->eventWait);
+}
+
+/**
+ * @brief Subscribes a file to the device events
+ *
+ * Events recorded before the subscription are not reported to the file. Subscribing again replaces the eventfd.
+ *
+ * @param mdev     Target device
+ * @param filp     File to subscribe
+ * @param eventfd  File descriptor of an eventfd signalled on every event, -1 for none
+ *
+ * @retval 0            Success
+ * @retval -EOPNOTSUPP  The board has no interrupt vector of its own or no DMA status register
+ * @retval -EBADF       eventfd is not an eventfd
+ * @retval -ENOMEM      Failed to allocate subscription
+ */
+int pcieuni_events_subscribe(module_dev* mdev, struct file* filp, int eventfd) {
+  pcieuni_event_sub* sub;
+  pcieuni_event_sub* old;
+  struct eventfd_ctx* oldEventfd = 0;
+
+  if(!mdev->irqExclusive || !pcieuni_dma_status_available(mdev)) return -EOPNOTSUPP;
+
+  sub = kzalloc(sizeof(pcieuni_event_sub), GFP_KERNEL);
+  if(!sub) return -ENOMEM;
+  sub->owner = filp;
+
+  if(eventfd >= 0) {
+    sub->eventfd = eventfd_ctx_fdget(eventfd);
+    if(IS_ERR(sub->eventfd)) {
+      kfree(sub);
+      return -EBADF;
+    }
+  }
+
+  spin_lock_irq(&mdev->eventLock);
+  old = pcieuni_events_find(mdev, filp);
+  if(old) {
+    oldEventfd = old->eventfd;
+    old->eventfd = sub->eventfd;
+  }
+  else {
+    sub->seen = mdev->eventCount;
+    list_add_tail(&sub->list, &mdev->eventSubs);
+  }
+  spin_unlock_irq(&mdev->eventLock);
+
+  if(old) {
+    if(oldEventfd) eventfd_ctx_put(oldEventfd);
+    kfree(sub);
+  }
+  return 0;
+}
+
+/**
+ * @brief Ends the subscription of a file to the device events
+ *
+ * @param mdev  Target device
+ * @param filp  Subscribed file
+ */
+void pcieuni_events_release_file(module_dev* mdev, struct file* filp) {
+  pcieuni_event_sub* sub;
+
+  spin_lock_irq(&mdev->eventLock);
+  sub = pcieuni_events_find(mdev, filp);
+  if(sub) list_del(&sub->list);
+  spin_unlock_irq(&mdev->eventLock);
+
+  if(sub) pcieuni_events_free(sub);
+}
+
+/**
+ * @brief Reads the event state of the board and marks all events as read by the file
+ *
+ * @param mdev   Target device
+ * @param filp   Subscribed file
+ * @param event  Returns the event state
+ *
+ * @retval 0        Success
+ * @retval -EINVAL  File is not subscribed
+ */
+int pcieuni_events_read(module_dev* mdev, struct file* filp, pcieuni_event* event) {
+  pcieuni_event_sub* sub;
+
+  spin_lock_irq(&mdev->eventLock);
+  sub = pcieuni_events_find(mdev, filp);
+  if(sub) {
+    event->count = mdev->eventCount;
+    event->timestamp_ns = mdev->eventNs;
+    event->pending = mdev->eventCount - sub->seen;
+    sub->seen = mdev->eventCount;
+  }
+  spin_unlock_irq(&mdev->eventLock);
+
+  return sub ? 0 : -EINVAL;
+}
+
+/**
+ * @brief Poll handler - EPOLLPRI while the file has events it did not read
+ *
+ * @param mdev  Target device
+ * @param filp  Polled file
+ * @param wait  Poll table
+ *
+ * @return Poll mask
+ */
+__poll_t pcieuni_events_poll(module_dev* mdev, struct file* filp, struct poll_table_struct* wait) {
+  __poll_t mask = 0;
+  pcieuni_event_sub* sub;
+
+  poll_wait(filp, &mdev->eventWait, wait);
+
+  spin_lock_irq(&mdev->eventLock);
+  sub = pcieuni_events_find(mdev, filp);
+  if(sub && sub->seen != mdev->eventCount) mask |= EPOLLPRI;
+  spin_unlock_irq(&mdev->eventLock);
+
+  return mask;
+}
@@ -5,25 +5,347 @@
 
 #include "pcieuni_fnc.h"
 
+#include <linux/delay.h>
+#include <linux/dma-mapping.h>
+#include <linux/highmem.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/scatterlist.h>
 #include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/topology.h>
+#include <linux/version.h>
+#include <linux/workqueue.h>
+
+#define CREATE_TRACE_POINTS
+#include "pcieuni_trace.h"
+
+/**
+ * @brief Unmaps and unpins the user pages of timed out zero-copy reads in module_dev::dmaOrphansDone
+ *
+ * @param work  module_dev::dmaOrphanWork
+ */
+static void pcieuni_dma_orphan_work(struct work_struct* work) {
+  module_dev* mdev = container_of(work, module_dev, dmaOrphanWork);
+  struct device* dmaDev = &mdev->parent_dev->pcieuni_pci_dev->dev;
+  pcieuni_dma_orphan* orphan;
+  pcieuni_dma_orphan* tmp;
+  unsigned long flags;
+  LIST_HEAD(done);
+
+  spin_lock_irqsave(&mdev->dmaOrphanLock, flags);
+  list_splice_init(&mdev->dmaOrphansDone, &done);
+  spin_unlock_irqrestore(&mdev->dmaOrphanLock, flags);
+
+  list_for_each_entry_safe(orphan, tmp, &done, list) {
+    dma_unmap_sgtable(dmaDev, &orphan->sgt, DMA_FROM_DEVICE, 0);
+    sg_free_table(&orphan->sgt);
+    unpin_user_pages_dirty_lock(orphan->pages, orphan->nPages, true);
+    kvfree(orphan->pages);
+    kfree(orphan);
+  }
+}
+
+/**
+ * @brief Arguments of pcieuni_buffer_create_fn()
+ */
+struct pcieuni_buffer_create_args {
+  pcieuni_dev* dev;   /**< Universal driver pci device structure */
+  unsigned long size; /**< Size of the buffer */
+};
+
+/**
+ * @brief Calls pcieuni_buffer_create(), run by work_on_cpu_safe()
+ *
+ * @param data  struct pcieuni_buffer_create_args
+ *
+ * @return Created buffer or error pointer
+ */
+static long pcieuni_buffer_create_fn(void* data) {
+  struct pcieuni_buffer_create_args* args = data;
+  return (long)pcieuni_buffer_create(args->dev, args->size);
+}
+
+/**
+ * @brief Allocates a DMA buffer on a NUMA node
+ *
+ * The universal driver allocates buffer memory on the node of the calling CPU, so the allocation is moved to a CPU of
+ * the target node if necessary.
+ *
+ * @param dev   Universal driver pci device structure
+ * @param size  Size of the buffer
+ * @param node  Target NUMA node or NUMA_NO_NODE
+ *
+ * @return Created buffer or error pointer
+ */
+static pcieuni_buffer* pcieuni_buffer_create_on_node(pcieuni_dev* dev, unsigned long size, int node) {
+  struct pcieuni_buffer_create_args args = {.dev = dev, .size = size};
+  unsigned int cpu;
+
+  if(node == NUMA_NO_NODE || node == numa_node_id()) return pcieuni_buffer_create(dev, size);
+
+  cpu = cpumask_any_and(cpumask_of_node(node), cpu_online_mask);
+  if(cpu >= nr_cpu_ids) return pcieuni_buffer_create(dev, size); // node without online CPU
+
+  return (pcieuni_buffer*)work_on_cpu_safe(cpu, pcieuni_buffer_create_fn, &args);
+}
+
+/**
+ * @brief Allocates a DMA buffer that is contiguous only in IOVA space
+ *
+ * The buffer is made of pages that the IOMMU maps into one contiguous DMA address range, so no high-order allocation
+ * is needed however large the buffer is. The CPU accesses it through a vmap() address in pcieuni_buffer::kaddr.
+ *
+ * @param mdev   Driver device structure
+ * @param size   Size of the buffer
+ * @param pages  Returns the pages of the buffer
+ *
+ * @return Created buffer or error pointer
+ * @retval -EOPNOTSUPP  The board is not behind an IOMMU or the kernel has no noncontiguous DMA allocation
+ * @retval -ENOMEM      Failed to allocate or map the buffer
+ */
+static pcieuni_buffer* pcieuni_dma_buffer_alloc_iova(module_dev* mdev, unsigned long size, struct sg_table** pages) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 15, 0)
+  struct device* dmaDev = &mdev->parent_dev->pcieuni_pci_dev->dev;
+  pcieuni_buffer* buffer;
+  void* kaddr;
+
+  // without an IOMMU the allocation would be physically contiguous anyway
+  if(!device_iommu_mapped(dmaDev)) return ERR_PTR(-EOPNOTSUPP);
+
+  buffer = kzalloc(sizeof(pcieuni_buffer), GFP_KERNEL);
+  if(!buffer) return ERR_PTR(-ENOMEM);
+
+  *pages = dma_alloc_noncontiguous(dmaDev, size, DMA_FROM_DEVICE, GFP_KERNEL, 0);
+  if(!*pages) goto cleanup_buffer;
+
+  kaddr = dma_vmap_noncontiguous(dmaDev, size, *pages);
+  if(!kaddr) goto cleanup_pages;
+
+  buffer->kaddr = (unsigned long)kaddr;
+  buffer->dma_handle = sg_dma_address((*pages)->sgl);
+  buffer->size = size;
+  return buffer;
+
+cleanup_pages:
+  dma_free_noncontiguous(dmaDev, size, *pages, DMA_FROM_DEVICE);
+cleanup_buffer:
+  kfree(buffer);
+  return ERR_PTR(-ENOMEM);
+#else
+  return ERR_PTR(-EOPNOTSUPP);
+#endif
+}
+
+/**
+ * @brief Allocates a DMA buffer, behind an IOMMU contiguous only in IOVA space
+ *
+ * Without an IOMMU (or if the IOVA allocation fails) the buffer is physically contiguous.
+ *
+ * @param mdev   Driver device structure
+ * @param size   Size of the buffer
+ * @param pages  Returns the pages of a buffer contiguous only in IOVA space, NULL for a physically contiguous buffer
+ *
+ * @return Created buffer or error pointer
+ */
+static pcieuni_buffer* pcieuni_dma_buffer_alloc(module_dev* mdev, unsigned long size, struct sg_table** pages) {
+  pcieuni_buffer* buffer = pcieuni_dma_buffer_alloc_iova(mdev, size, pages);
+
+  if(!IS_ERR(buffer)) return buffer;
+
+  *pages = 0;
+  return pcieuni_buffer_create_on_node(mdev->parent_dev, size, mdev->node);
+}
+
+/**
+ * @brief Frees a DMA buffer allocated by pcieuni_dma_buffer_alloc()
+ *
+ * @param mdev    Driver device structure
+ * @param buffer  Buffer, not in any buffer list unless it is physically contiguous
+ * @param pages   Pages of the buffer returned by pcieuni_dma_buffer_alloc()
+ * @param unused  A physically contiguous buffer is appended to this list, which frees it when cleared
+ */
+static void pcieuni_dma_buffer_free(
+    module_dev* mdev, pcieuni_buffer* buffer, struct sg_table* pages, struct pcieuni_buffer_list* unused) {
+  if(!pages) {
+    pcieuni_bufferList_append(unused, buffer);
+    return;
+  }
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 15, 0)
+  dma_vunmap_noncontiguous(&mdev->parent_dev->pcieuni_pci_dev->dev, (void*)buffer->kaddr);
+  dma_free_noncontiguous(&mdev->parent_dev->pcieuni_pci_dev->dev, buffer->size, pages, DMA_FROM_DEVICE);
+#endif
+  kfree(buffer);
+}
+
+/**
+ * @brief Syncs the transferred part of a DMA buffer allocated by pcieuni_dma_buffer_alloc()
+ *
+ * A contiguous buffer is synced for its transferred part only. A noncontiguous buffer is synced as the whole mapped
+ * table, and its vmap() alias in pcieuni_buffer::kaddr is flushed before and invalidated after the transfer, so the
+ * CPU does not see stale cache lines of the alias.
+ *
+ * @param mdev       Driver device structure
+ * @param buffer     Buffer, its first pcieuni_buffer::dma_size bytes hold the transfer
+ * @param pages      Pages of the buffer returned by pcieuni_dma_buffer_alloc()
+ * @param forDevice  Sync for the device before the transfer, otherwise for the CPU after it
+ */
+static void pcieuni_dma_buffer_sync(module_dev* mdev, pcieuni_buffer* buffer, struct sg_table* pages, bool forDevice) {
+  struct device* dmaDev = &mdev->parent_dev->pcieuni_pci_dev->dev;
+
+  if(!pages) {
+    if(forDevice) {
+      dma_sync_single_for_device(dmaDev, buffer->dma_handle, buffer->dma_size, DMA_FROM_DEVICE);
+    }
+    else {
+      dma_sync_single_for_cpu(dmaDev, buffer->dma_handle, buffer->dma_size, DMA_FROM_DEVICE);
+    }
+    return;
+  }
+
+  if(forDevice) {
+    flush_kernel_vmap_range((void*)buffer->kaddr, buffer->size);
+    dma_sync_sgtable_for_device(dmaDev, pages, DMA_FROM_DEVICE);
+  }
+  else {
+    dma_sync_sgtable_for_cpu(dmaDev, pages, DMA_FROM_DEVICE);
+    invalidate_kernel_vmap_range((void*)buffer->kaddr, buffer->size);
+  }
+}
+
+/**
+ * @brief Frees the DMA buffers of a pool that are not in the buffer list
+ *
+ * @param mdev      Driver device structure
+ * @param slots     Slots holding the buffers, freed as well
+ * @param nBuffers  Number of buffers
+ */
+static void pcieuni_dma_pool_free(module_dev* mdev, pcieuni_dma_slot* slots, int nBuffers) {
+  struct pcieuni_buffer_list unused;
+  int i;
+
+  // the buffer list frees the physically contiguous buffers
+  pcieuni_bufferList_init(&unused, mdev->parent_dev);
+  for(i = 0; i < nBuffers; i++) {
+    pcieuni_dma_buffer_free(mdev, slots[i].buffer, slots[i].pages, &unused);
+  }
+  pcieuni_bufferList_clear(&unused);
+  kfree(slots);
+}
+
+/**
+ * @brief Frees the preallocated DMA buffers of a board, which are in the buffer list
+ * @note The buffers must not be in use.
+ *
+ * @param mdev  Driver device structure
+ */
+static void pcieuni_dma_pool_clear(module_dev* mdev) {
+  int i;
+
+  // the buffer list can only free physically contiguous buffers, the others are taken out of it first
+  for(i = 0; i < mdev->dmaSlotCount; i++) {
+    if(!mdev->dmaSlots[i].pages) continue;
+    spin_lock(&mdev->dmaBuffers.lock);
+    list_del(&mdev->dmaSlots[i].buffer->list);
+    spin_unlock(&mdev->dmaBuffers.lock);
+    pcieuni_dma_buffer_free(mdev, mdev->dmaSlots[i].buffer, mdev->dmaSlots[i].pages, 0);
+  }
+  pcieuni_bufferList_clear(&mdev->dmaBuffers);
+  kfree(mdev->dmaSlots);
+
+  spin_lock(&mdev->dmaSlotLock);
+  mdev->dmaSlots = 0;
+  mdev->dmaSlotCount = 0;
+  spin_unlock(&mdev->dmaSlotLock);
+}
+
+/**
+ * @brief Allocates the DMA buffers of a pool
+ *
+ * Behind an IOMMU the buffers are contiguous only in IOVA space, so large buffers do not need high-order contiguous
+ * memory. They are still mapped into user space as one ring, see pcieuni_dma_ring_mmap().
+ *
+ * @param mdev        Driver device structure
+ * @param bufferSize  Size of the buffers
+ * @param nBuffers    Number of buffers
+ * @param nLocal      Returns number of buffers on the NUMA node of the board
+ *
+ * @return Slots holding the buffers, which are not yet in the buffer list
+ * @retval -ENOMEM  Failed to allocate the slots or a buffer, nothing is left allocated
+ */
+static pcieuni_dma_slot* pcieuni_dma_pool_alloc(
+    module_dev* mdev, unsigned long bufferSize, ushort nBuffers, int* nLocal) {
+  pcieuni_dma_slot* slots;
+  pcieuni_buffer* buffer;
+  struct page* first;
+  ushort i;
+
+  slots = kcalloc(nBuffers, sizeof(pcieuni_dma_slot), GFP_KERNEL);
+  if(!slots) return ERR_PTR(-ENOMEM);
+
+  *nLocal = 0;
+  for(i = 0; i < nBuffers; i++) {
+    buffer = pcieuni_dma_buffer_alloc(mdev, bufferSize, &slots[i].pages);
+    if(IS_ERR(buffer)) {
+      pcieuni_dma_pool_free(mdev, slots, i);
+      return ERR_CAST(buffer);
+    }
+    slots[i].buffer = buffer;
+    first = slots[i].pages ? sg_page(slots[i].pages->sgl) : virt_to_page((void*)buffer->kaddr);
+    if(page_to_nid(first) == mdev->node) (*nLocal)++;
+  }
+
+  return slots;
+}
+
+/**
+ * @brief Puts the buffers allocated by pcieuni_dma_pool_alloc() into use
+ * @note The buffer list must be empty.
+ *
+ * @param mdev        Driver device structure
+ * @param slots       Slots holding the buffers
+ * @param bufferSize  Size of the buffers
+ * @param nBuffers    Number of buffers
+ * @param nLocal      Number of buffers on the NUMA node of the board
+ */
+static void pcieuni_dma_pool_set(
+    module_dev* mdev, pcieuni_dma_slot* slots, unsigned long bufferSize, ushort nBuffers, int nLocal) {
+  ushort i;
+
+  for(i = 0; i < nBuffers; i++) {
+    pcieuni_bufferList_append(&mdev->dmaBuffers, slots[i].buffer);
+  }
+
+  spin_lock(&mdev->dmaSlotLock);
+  mdev->dmaSlots = slots;
+  mdev->dmaSlotCount = nBuffers;
+  mdev->dmaSlotSize = PAGE_ALIGN(bufferSize);
+  mdev->dmaBufferSize = bufferSize;
+  mdev->dmaBuffersLocal = nLocal;
+  spin_unlock(&mdev->dmaSlotLock);
+}
 
 /**
  * @brief Allocates and initializes driver specific part of pci device data
  *
+ * The DMA buffers are allocated on the NUMA node of the board, so neither the device nor the copy to user space on
+ * that node cross the interconnect between the sockets.
+ *
  * @param brd_num       Device index in the list of probed devices
  * @param pcidev        Universal driver pci device structure
- * @param kbuf_blk_num  Number of preallocated DMA buffers
- * @param kbuf_blk_size Size of preallocated DMA buffers
+ * @param bufferSize    Size of preallocated DMA buffers
+ * @param nBuffers      Number of preallocated DMA buffers
  *
  * @return  Allocated module_dev structure
  * @retval  -ENOMEM     Failed - could not allocate memory
  */
-module_dev* pcieuni_create_mdev(int brd_num, pcieuni_dev* pcidev, unsigned long bufferSize) {
+module_dev* pcieuni_create_mdev(int brd_num, pcieuni_dev* pcidev, unsigned long bufferSize, ushort nBuffers) {
   module_dev* mdev;
-  pcieuni_buffer* buffer;
-  ushort i;
+  pcieuni_dma_slot* slots;
+  unsigned long size;
+  int nLocal;
 
-  PDEBUG(pcidev->name, "pcieuni_create_mdev(brd_num=%i)", brd_num);
+  PDEBUG(pcidev->name, "pcieuni_create_mdev(brd_num=%i, nBuffers=%u)", brd_num, nBuffers);
 
 #ifdef PCIEUNI_TEST_MDEV_ALLOC_FAILURE
   TEST_RANDOM_EXIT(1, "PCIEUNI: Simulating failed allocation of module_dev structure!", ERR_PTR(-ENOMEM))
@@ -35,27 +357,47 @@ module_dev* pcieuni_create_mdev(int brd_num, pcieuni_dev* pcidev, unsigned long
   }
   mdev->brd_num = brd_num;
   mdev->parent_dev = pcidev;
+  mdev->node = dev_to_node(&pcidev->pcieuni_pci_dev->dev);
+
+  spin_lock_init(&mdev->dmaSlotLock);
 
   // initalize dma buffer list
   pcieuni_bufferList_init(&mdev->dmaBuffers, pcidev);
 
-  // allocate DMA buffers
-  for(i = 0; i < 2; i++) {
-    buffer = pcieuni_buffer_create(pcidev, bufferSize);
-    if(IS_ERR(buffer)) break;
-    pcieuni_bufferList_append(&mdev->dmaBuffers, buffer);
+  // allocate DMA buffers, without an IOMMU fragmented memory may only have smaller contiguous blocks left
+  for(size = bufferSize;; size = rounddown(size / 2, PCIEUNI_DMA_ALLOC_ALIGN)) {
+    slots = pcieuni_dma_pool_alloc(mdev, size, nBuffers, &nLocal);
+    if(!IS_ERR(slots) || size / 2 < PCIEUNI_DMA_ALLOC_ALIGN) break;
   }
 
-  if(IS_ERR(buffer)) {
+  // the board is still usable without them except for DMA
+  if(IS_ERR(slots)) {
     printk(KERN_ERR "pcieuni(%s): failed to allocate DMA buffers!\n", pcidev->name);
-    pcieuni_bufferList_clear(&mdev->dmaBuffers);
+  }
+  else {
+    if(size != bufferSize) {
+      printk(KERN_WARNING "pcieuni(%s): allocated %u x %lu kB DMA buffers instead of %lu kB\n", pcidev->name,
+          nBuffers, size / 1024, bufferSize / 1024);
+    }
+    pcieuni_dma_pool_set(mdev, slots, size, nBuffers, nLocal);
   }
 
-  init_waitqueue_head(&mdev->waitDMA);
-  sema_init(&mdev->dma_sem, 1);
+  spin_lock_init(&mdev->dmaLock);
+  INIT_LIST_HEAD(&mdev->dmaQueue);
+  spin_lock_init(&mdev->dmaOrphanLock);
+  INIT_LIST_HEAD(&mdev->dmaOrphans);
+  INIT_LIST_HEAD(&mdev->dmaOrphansDone);
+  INIT_WORK(&mdev->dmaOrphanWork, pcieuni_dma_orphan_work);
+  INIT_LIST_HEAD(&mdev->triggerArmed);
+  mutex_init(&mdev->dmaReadMutex);
+  mutex_init(&mdev->dmaShareMutex);
+  pcieuni_dma_async_init(mdev);
+  pcieuni_events_init(mdev);
+  pcieuni_dma_stream_init(mdev);
 
-  mdev->waitFlag = 1;
   mdev->dma_buffer = 0;
+  mdev->dma_xfer = 0;
+  pcieuni_stats_add(mdev);
 
   return mdev;
 }
@@ -71,8 +413,22 @@ void pcieuni_release_mdev(module_dev* mdev) {
   if(!IS_ERR_OR_NULL(mdev)) {
     PDEBUG(mdev->parent_dev->name, "pcieuni_release_mdev()");
 
+    pcieuni_stats_remove(mdev);
+
+    // stop streaming and drop asynchronous requests, they may hold DMA buffers
+    pcieuni_dma_stream_cleanup(mdev);
+    pcieuni_dma_async_cleanup(mdev);
+    pcieuni_dma_merge_cleanup(mdev);
+    pcieuni_events_cleanup(mdev);
+
+    // the board is gone, the DMA engine does not write to the pages of timed out reads any more
+    cancel_work_sync(&mdev->dmaOrphanWork);
+    list_splice_tail_init(&mdev->dmaOrphans, &mdev->dmaOrphansDone);
+    pcieuni_dma_orphan_work(&mdev->dmaOrphanWork);
+
     // clear the buffers gracefully
-    pcieuni_bufferList_clear(&mdev->dmaBuffers);
+    pcieuni_dma_pool_clear(mdev);
+    pcieuni_dma_classes_free(mdev);
 
     // clear the module_dev structure
     kfree(mdev);
@@ -91,67 +447,771 @@ module_dev* pcieuni_get_mdev(struct pcieuni_dev* dev) {
 }
 
 /**
- * @brief Reserves DMA read process on target device
+ * @brief Starts DMA transfer into the target buffer on the idle DMA engine
+ * @note Called with module_dev::dmaLock held.
+ *
+ * @param mdev  Driver device structure
+ * @param xfer  Queue entry of the transfer
+ *
+ * @retval 0     Success
+ * @retval -EIO  Failed to write to device registers
+ */
+static int pcieuni_dma_start(module_dev* mdev, pcieuni_dma_xfer* xfer) {
+  int retVal;
+  pcieuni_buffer* buffer = xfer->buffer;
+
+  ktime_get_real_ts64(&(mdev->dma_start_time));
+  mdev->dmaStartNs = ktime_get_ns();
+  xfer->startNs = mdev->dmaStartNs;
+
+  // Setup env for irq handler
+  mdev->dma_buffer = buffer;
+  mdev->dma_xfer = xfer;
+  trace_pcieuni_dma_start(mdev->brd_num, buffer, buffer->dma_offset, buffer->dma_size);
+
+  retVal = pcieuni_dma_program(mdev->parent_dev, buffer, xfer->toDevice);
+  if(retVal) {
+    printk(KERN_ERR "pcieuni(%s): failed to start DMA (offset=0x%lx, size=0x%lx)!\n", mdev->parent_dev->name,
+        buffer->dma_offset, buffer->dma_size);
+    mdev->dma_buffer = 0;
+    mdev->dma_xfer = 0;
+  }
+
+  return retVal;
+}
+
+/**
+ * @brief Queues DMA read process on target device with module_dev::dmaLock held
  *
- * @note This function will block until device is ready to acceept DMA request.
+ * Same as pcieuni_dma_queue() for callers already holding the lock, e.g. the streaming acquisition re-arming itself
+ * from the interrupt thread.
  *
  * @param   mdev   PCI device
  * @param   buffer Target DMA buffer
+ * @param   xfer   Queue entry, must stay valid until the transfer is finished or cancelled
  *
- * @retval  0      Success
- * @retval  -EINTR Operation was interrupted
- * @retval  -EBUSY Operation timed out
+ * @retval  0       Success
+ * @retval  -EIO    Failed to write to device registers
+ * @retval  -ENODEV The DMA engine is stopped for the removal of the board, see pcieuni_dma_stop()
  */
-int pcieuni_dma_reserve(module_dev* mdev, pcieuni_buffer* buffer) {
-  long waitVal = 0;
-  long timeout = HZ / 1;
+int pcieuni_dma_queue_locked(module_dev* mdev, pcieuni_buffer* buffer, pcieuni_dma_xfer* xfer) {
+  int retVal = 0;
 
-  PDEBUG(mdev->parent_dev->name, "pcieuni_dma_reserve()");
+  if(mdev->dmaStopped) return -ENODEV;
 
-  // protect against concurrent reservation of waitFlag
-  down(&mdev->dma_sem);
+  xfer->buffer = buffer;
+  INIT_LIST_HEAD(&xfer->list);
 
-  while(!mdev->waitFlag) {
-    // wait for DMA to be available
-    up(&mdev->dma_sem);
+  if(mdev->dma_buffer) {
+    list_add_tail(&xfer->list, &mdev->dmaQueue);
+    atomic64_inc(&mdev->stats.queueWaits);
+    trace_pcieuni_dma_queue(mdev->brd_num, buffer, buffer->dma_offset, buffer->dma_size);
+  }
+  else {
+    retVal = pcieuni_dma_start(mdev, xfer);
+  }
 
-    PDEBUG(mdev->parent_dev->name, "pcieuni_dma_reserve(): Waiting until dma available...\n");
-    waitVal = wait_event_timeout(mdev->waitDMA, mdev->waitFlag, timeout);
-    if(0 == waitVal) {
-      printk(KERN_ERR "pcieuni(%s): error waiting for DMA to become available: Timeout!\n", mdev->parent_dev->name);
-      return -EBUSY;
-    }
-    else if(0 > waitVal) {
-      PDEBUG(mdev->parent_dev->name, "pcieuni_dma_reserve(): Interrupted!\n");
-      return -EINTR;
-    }
+  return retVal;
+}
+
+/**
+ * @brief Queues DMA read process on target device
+ *
+ * If the DMA engine is idle the transfer is started right away. Otherwise it is appended to the DMA queue and started
+ * by the interrupt handler once the transfers queued before it are finished.
+ * @note This function does not block.
+ *
+ * @param   mdev   PCI device
+ * @param   buffer Target DMA buffer
+ * @param   xfer   Queue entry, must stay valid until the transfer is finished or cancelled
+ *
+ * @retval  0       Success
+ * @retval  -EBUSY  Operation timed out
+ * @retval  -EIO    Failed to write to device registers
+ * @retval  -ENODEV The DMA engine is stopped for the removal of the board, see pcieuni_dma_stop()
+ */
+int pcieuni_dma_queue(module_dev* mdev, pcieuni_buffer* buffer, pcieuni_dma_xfer* xfer) {
+  int retVal = 0;
+  unsigned long flags;
+
+  PDEBUG(mdev->parent_dev->name, "pcieuni_dma_queue()");
 
 #ifdef PCIEUNI_TEST_DEVICE_DMA_BLOCKED
-    TEST_RANDOM_EXIT(100, "PCIEUNI: Simulating blocked DMA !", -EBUSY)
+  TEST_RANDOM_EXIT(100, "PCIEUNI: Simulating blocked DMA !", -EBUSY)
 #endif
 
-    // protect against concurrent reservation of waitFlag
-    down(&mdev->dma_sem);
-  }
+  spin_lock_irqsave(&mdev->dmaLock, flags);
+  retVal = pcieuni_dma_queue_locked(mdev, buffer, xfer);
+  spin_unlock_irqrestore(&mdev->dmaLock, flags);
 
-  // Mark DMA read operation reserved and set the target buffer
-  mdev->waitFlag = 0;
-  mdev->dma_buffer = buffer;
-  up(&mdev->dma_sem);
+  return retVal;
+}
 
-  return 0;
+/**
+ * @brief Finishes the current DMA read process after the end of DMA interrupt
+ *
+ * Marks the target buffer as filled, updates the statistics and starts the next queued transfer. Then the waiting
+ * process is woken up through pcieuni_dma_xfer::finished, or a transfer without a waiting process is handed to its
+ * pcieuni_dma_xfer::done callback.
+ * @note This function is called from the threaded interrupt handler with module_dev::dmaLock held, so it must not
+ * block.
+ *
+ * @param mdev   Driver device structure
+ * @param irqNs  Time of the end of DMA interrupt (ktime_get_ns())
+ */
+void pcieuni_dma_complete(module_dev* mdev, u64 irqNs) {
+  pcieuni_dma_xfer* xfer = mdev->dma_xfer;
+  pcieuni_dma_done_fn done = xfer->done;
+
+  trace_pcieuni_dma_irq(
+      mdev->brd_num, mdev->dma_buffer, mdev->dma_buffer->dma_offset, mdev->dma_buffer->dma_size);
+  atomic64_inc(&mdev->stats.transfers);
+  atomic64_add(mdev->dma_buffer->dma_size, &mdev->stats.bytes);
+  pcieuni_stats_hist_add(mdev->stats.dmaLatency, irqNs - mdev->dmaStartNs);
+
+  xfer->doneNs = irqNs;
+  clear_bit(BUFFER_STATE_WAITING, &mdev->dma_buffer->state);
+  pcieuni_dma_release(mdev);
+  pcieuni_dma_orphans_done(mdev);
+
+  // the waiting process may return and free the transfer as soon as it is completed, so this is the last access
+  if(done) {
+    done(mdev, xfer);
+  }
+  else {
+    complete_all(&xfer->finished);
+  }
 }
 
 /**
- * @brief Releases DMA read process on target device
+ * @brief Releases DMA read process on target device and starts the next queued transfer
  *
- * @note This function is called from interrupt handler so it must not block.
+ * @note This function is called from interrupt handler with module_dev::dmaLock held, so it must not block.
  *
  * @param mdev  Driver device structure
  */
 void pcieuni_dma_release(module_dev* mdev) {
+  pcieuni_dma_xfer* next;
+
   PDEBUG(mdev->parent_dev->name, "pcieuni_dma_release()");
-  mdev->waitFlag = 1;
+  if(mdev->dma_buffer) {
+    trace_pcieuni_dma_release(
+        mdev->brd_num, mdev->dma_buffer, mdev->dma_buffer->dma_offset, mdev->dma_buffer->dma_size);
+  }
   mdev->dma_buffer = 0;
-  wake_up(&(mdev->waitDMA));
+  mdev->dma_xfer = 0;
+  mdev->dmaIrqPending = false;
+
+  while((next = list_first_entry_or_null(&mdev->dmaQueue, pcieuni_dma_xfer, list))) {
+    list_del_init(&next->list);
+    // if the transfer can not be started its waiter runs into the timeout
+    if(!pcieuni_dma_start(mdev, next)) break;
+  }
+}
+
+/**
+ * @brief Removes DMA transfer into the target buffer from the DMA engine
+ *
+ * A queued transfer is dropped. If the transfer is running it is assumed that the interrupt was missed, so the DMA
+ * engine is released and the next queued transfer is started.
+ *
+ * @param mdev    Driver device structure
+ * @param buffer  Target DMA buffer
+ */
+void pcieuni_dma_cancel(module_dev* mdev, pcieuni_buffer* buffer) {
+  unsigned long flags;
+
+  PDEBUG(mdev->parent_dev->name, "pcieuni_dma_cancel(offset=0x%lx)", buffer->dma_offset);
+
+  spin_lock_irqsave(&mdev->dmaLock, flags);
+  pcieuni_dma_cancel_locked(mdev, buffer);
+  spin_unlock_irqrestore(&mdev->dmaLock, flags);
+}
+
+/**
+ * @brief Same as pcieuni_dma_cancel() for callers already holding module_dev::dmaLock
+ *
+ * @param mdev    Driver device structure
+ * @param buffer  Target DMA buffer
+ */
+void pcieuni_dma_cancel_locked(module_dev* mdev, pcieuni_buffer* buffer) {
+  pcieuni_dma_xfer* xfer;
+  pcieuni_dma_xfer* tmp;
+
+  list_for_each_entry_safe(xfer, tmp, &mdev->dmaQueue, list) {
+    if(xfer->buffer == buffer) list_del_init(&xfer->list);
+  }
+  if(mdev->dma_buffer == buffer) {
+    pcieuni_dma_release(mdev);
+  }
+  clear_bit(BUFFER_STATE_WAITING, &buffer->state);
+}
+
+/**
+ * @brief Hands the user pages of a timed out zero-copy read over to the DMA engine
+ *
+ * The DMA engine was released after the timeout, but it may still be writing to the pages. Once the engine signals
+ * the end of a later transfer it is done with them (see pcieuni_dma_orphans_done()), and they are unmapped and
+ * unpinned by module_dev::dmaOrphanWork. The pages left at the removal of the board are freed by
+ * pcieuni_release_mdev().
+ *
+ * @param mdev    Driver device structure
+ * @param orphan  Pinned and mapped pages, freed with kfree() once the engine is done with them
+ */
+void pcieuni_dma_orphan_add(module_dev* mdev, pcieuni_dma_orphan* orphan) {
+  unsigned long flags;
+
+  spin_lock_irqsave(&mdev->dmaOrphanLock, flags);
+  list_add_tail(&orphan->list, &mdev->dmaOrphans);
+  spin_unlock_irqrestore(&mdev->dmaOrphanLock, flags);
+}
+
+/**
+ * @brief Frees the user pages of timed out zero-copy reads after the end of a later DMA transfer
+ *
+ * The engine finished a transfer after the timed out ones, so it does not write to their pages any more.
+ * @note This function is called from interrupt handler so it must not block.
+ *
+ * @param mdev  Driver device structure
+ */
+void pcieuni_dma_orphans_done(module_dev* mdev) {
+  unsigned long flags;
+
+  spin_lock_irqsave(&mdev->dmaOrphanLock, flags);
+  if(!list_empty(&mdev->dmaOrphans)) {
+    list_splice_tail_init(&mdev->dmaOrphans, &mdev->dmaOrphansDone);
+    schedule_work(&mdev->dmaOrphanWork);
+  }
+  spin_unlock_irqrestore(&mdev->dmaOrphanLock, flags);
+}
+
+/**
+ * @brief Checks on a DMA transfer whose end of DMA interrupt did not come yet
+ *
+ * If the status register (see pcieuni_dma_engine_status()) says the running transfer is done, the interrupt was lost
+ * and the transfer is finished as the interrupt thread would have done.
+ * @note Called with module_dev::dmaLock held.
+ *
+ * @param mdev       Driver device structure
+ * @param xfer       Queue entry of the transfer
+ * @param timeoutNs  Time the transfer may take on the DMA engine
+ *
+ * @retval 0           The transfer is finished
+ * @retval -EAGAIN     The transfer is queued, running within its time or its interrupt is not processed yet
+ * @retval -ETIMEDOUT  The transfer is running for longer than timeoutNs
+ * @retval -EIO        The transfer was dropped from the queue because it could not be started
+ */
+int pcieuni_dma_watchdog_locked(module_dev* mdev, pcieuni_dma_xfer* xfer, u64 timeoutNs) {
+  if(!test_bit(BUFFER_STATE_WAITING, &xfer->buffer->state)) return 0;
+
+  if(mdev->dma_xfer != xfer) return list_empty(&xfer->list) ? -EIO : -EAGAIN;
+
+  // the transfer is done, the interrupt thread did not run yet and must not find it cancelled
+  if(mdev->dmaIrqPending) return -EAGAIN;
+
+  if(pcieuni_dma_engine_status(mdev) == 1) {
+    printk(KERN_WARNING "pcieuni(%s): missed end of DMA interrupt (offset=0x%lx, size=0x%lx)\n",
+        mdev->parent_dev->name, xfer->buffer->dma_offset, xfer->buffer->dma_size);
+    atomic64_inc(&mdev->stats.irqMissed);
+    pcieuni_dma_complete(mdev, ktime_get_ns());
+    return 0;
+  }
+
+  return ktime_get_ns() - xfer->startNs >= timeoutNs ? -ETIMEDOUT : -EAGAIN;
+}
+
+/**
+ * @brief Same as pcieuni_dma_watchdog_locked() for callers not holding module_dev::dmaLock
+ *
+ * @param mdev       Driver device structure
+ * @param xfer       Queue entry of the transfer
+ * @param timeoutNs  Time the transfer may take on the DMA engine
+ *
+ * @return Result of pcieuni_dma_watchdog_locked()
+ */
+int pcieuni_dma_watchdog(module_dev* mdev, pcieuni_dma_xfer* xfer, u64 timeoutNs) {
+  int retVal;
+  unsigned long flags;
+
+  spin_lock_irqsave(&mdev->dmaLock, flags);
+  retVal = pcieuni_dma_watchdog_locked(mdev, xfer, timeoutNs);
+  spin_unlock_irqrestore(&mdev->dmaLock, flags);
+
+  return retVal;
+}
+
+/**
+ * @brief Stops the DMA engine of a board that is being removed, before its interrupt is freed
+ *
+ * No transfer is queued any more, armed triggered reads fail with -ENODEV. The streaming acquisition and the
+ * asynchronous requests are stopped while their reads still end with the interrupt. The transfers still queued are
+ * dropped, their waiting processes see them dropped (see pcieuni_dma_watchdog_locked()) and return -EIO. The running
+ * transfer is given its timeout to finish, then the engine is released without finishing it.
+ * @note This function may block.
+ *
+ * @param mdev  Driver device structure
+ */
+void pcieuni_dma_stop(module_dev* mdev) {
+  pcieuni_dma_xfer* xfer;
+  pcieuni_dma_xfer* tmp;
+  u64 deadline;
+
+  PDEBUG(mdev->parent_dev->name, "pcieuni_dma_stop()");
+
+  spin_lock_irq(&mdev->dmaLock);
+  mdev->dmaStopped = true;
+  // the armed reads fail to queue now, so firing the trigger hands the error to their waiting processes
+  pcieuni_dma_trigger_fire(mdev, ktime_get_ns());
+  spin_unlock_irq(&mdev->dmaLock);
+
+  pcieuni_dma_stream_cleanup(mdev);
+  pcieuni_dma_async_cleanup(mdev);
+
+  spin_lock_irq(&mdev->dmaLock);
+  list_for_each_entry_safe(xfer, tmp, &mdev->dmaQueue, list) {
+    list_del_init(&xfer->list);
+  }
+  deadline = mdev->dma_buffer ? mdev->dmaStartNs + pcieuni_dma_timeout_ns(mdev, mdev->dma_buffer->dma_size) : 0;
+  spin_unlock_irq(&mdev->dmaLock);
+
+  while(READ_ONCE(mdev->dma_buffer) && ktime_get_ns() < deadline) {
+    msleep(1);
+  }
+
+  spin_lock_irq(&mdev->dmaLock);
+  if(mdev->dma_buffer) {
+    printk(KERN_WARNING "pcieuni(%s): DMA (offset=0x%lx, size=0x%lx) still running at removal\n",
+        mdev->parent_dev->name, mdev->dma_buffer->dma_offset, mdev->dma_buffer->dma_size);
+    // the buffer stays waiting, so its process does not take the transfer for finished
+    pcieuni_dma_release(mdev);
+  }
+  spin_unlock_irq(&mdev->dmaLock);
+}
+
+/**
+ * @brief Checks the size of the preallocated DMA buffers, at probe (::kbuf_blk_sz_kb) and at runtime
+ *
+ * @param bufferSize  Size of the buffers
+ *
+ * @return true if the size is a power of 2 between 4 kB and 4 MB
+ */
+bool pcieuni_dma_pool_size_valid(unsigned long bufferSize) {
+  return is_power_of_2(bufferSize) && bufferSize >= 4 * 1024 && bufferSize <= 4096 * 1024;
+}
+
+/**
+ * @brief Replaces the DMA buffers of a board by buffers of another size and count
+ *
+ * The pool is only rebuilt while the board does not use it: no DMA transfer through the buffers, no held ring slot or
+ * asynchronous request and no mapping of the DMA ring. DMA reads arriving meanwhile wait for the rebuild,
+ * ring reads and asynchronous requests fail with -EBUSY. The new buffers are allocated before the old ones are freed,
+ * so the old pool stays in use if the allocation fails.
+ * @note This function may block.
+ *
+ * @param mdev        Driver device structure
+ * @param bufferSize  Size of the buffers, see pcieuni_dma_pool_size_valid()
+ * @param nBuffers    Number of buffers (at least 2)
+ *
+ * @retval 0             Success
+ * @retval -EINVAL       Invalid size or count
+ * @retval -EBUSY        The buffers are in use
+ * @retval -ENOMEM       Failed to allocate the new buffers, the old buffers stay in use
+ * @retval -ERESTARTSYS  Interrupted while waiting for a running DMA read
+ */
+int pcieuni_dma_pool_resize(module_dev* mdev, unsigned long bufferSize, unsigned int nBuffers) {
+  int retVal = 0;
+  bool busy;
+  pcieuni_dma_slot* slots;
+  int nLocal;
+
+  PDEBUG(mdev->parent_dev->name, "pcieuni_dma_pool_resize(bufferSize=0x%lx, nBuffers=%u)", bufferSize, nBuffers);
+
+  if(nBuffers < 2 || nBuffers > USHRT_MAX) return -EINVAL;
+  if(!pcieuni_dma_pool_size_valid(bufferSize)) return -EINVAL;
+
+  if(mutex_lock_interruptible(&mdev->dmaReadMutex)) return -ERESTARTSYS;
+
+  spin_lock(&mdev->dmaSlotLock);
+  busy = mdev->dmaBuffersUsed || mdev->dmaBuffersHeld || mdev->dmaRingMaps;
+  if(!busy) mdev->dmaPoolResizing = true;
+  spin_unlock(&mdev->dmaSlotLock);
+
+  if(busy) {
+    retVal = -EBUSY;
+    goto cleanup_mutex;
+  }
+
+  slots = pcieuni_dma_pool_alloc(mdev, bufferSize, nBuffers, &nLocal);
+  if(IS_ERR(slots)) {
+    retVal = PTR_ERR(slots);
+    goto cleanup_resizing;
+  }
+
+  pcieuni_dma_pool_clear(mdev);
+  pcieuni_bufferList_init(&mdev->dmaBuffers, mdev->parent_dev);
+  pcieuni_dma_pool_set(mdev, slots, bufferSize, nBuffers, nLocal);
+
+  printk(KERN_INFO "pcieuni(%s): DMA buffers resized to %u x %lu kB\n", mdev->parent_dev->name, nBuffers,
+      bufferSize / 1024);
+
+cleanup_resizing:
+  spin_lock(&mdev->dmaSlotLock);
+  mdev->dmaPoolResizing = false;
+  spin_unlock(&mdev->dmaSlotLock);
+
+cleanup_mutex:
+  mutex_unlock(&mdev->dmaReadMutex);
+  return retVal;
+}
+
+/**
+ * @brief Takes one DMA buffer out of the buffer list for a longer time
+ *
+ * Buffers may be held for a longer time by DMA ring slots and asynchronous DMA requests. One buffer is always left
+ * for the regular DMA read, so it can not be starved by them.
+ *
+ * @param mdev  Driver device structure
+ *
+ * @retval 0       Success
+ * @retval -EBUSY  No buffer may be held or the buffers are being replaced
+ */
+int pcieuni_dma_hold_buffer(module_dev* mdev) {
+  int retVal = 0;
+
+  spin_lock(&mdev->dmaSlotLock);
+  if(mdev->dmaPoolResizing || mdev->dmaBuffersHeld + 1 >= mdev->dmaSlotCount) {
+    retVal = -EBUSY;
+  }
+  else {
+    mdev->dmaBuffersHeld++;
+    mdev->dmaBuffersUsed++;
+  }
+  spin_unlock(&mdev->dmaSlotLock);
+
+  return retVal;
+}
+
+/**
+ * @brief Returns a DMA buffer taken with pcieuni_dma_hold_buffer()
+ *
+ * @param mdev  Driver device structure
+ */
+void pcieuni_dma_unhold_buffer(module_dev* mdev) {
+  spin_lock(&mdev->dmaSlotLock);
+  mdev->dmaBuffersHeld--;
+  mdev->dmaBuffersUsed--;
+  spin_unlock(&mdev->dmaSlotLock);
+}
+
+/**
+ * @brief Takes one DMA buffer out of the buffer list for a single DMA transfer if one is free
+ *
+ * @param mdev  Driver device structure
+ *
+ * @return true if a buffer was taken
+ */
+bool pcieuni_dma_try_use_buffer(module_dev* mdev) {
+  bool taken = false;
+
+  spin_lock(&mdev->dmaSlotLock);
+  if(mdev->dmaBuffersUsed < mdev->dmaSlotCount) {
+    mdev->dmaBuffersUsed++;
+    taken = true;
+  }
+  spin_unlock(&mdev->dmaSlotLock);
+
+  return taken;
+}
+
+/**
+ * @brief Returns a DMA buffer taken with pcieuni_dma_try_use_buffer()
+ *
+ * @param mdev  Driver device structure
+ */
+void pcieuni_dma_unuse_buffer(module_dev* mdev) {
+  spin_lock(&mdev->dmaSlotLock);
+  mdev->dmaBuffersUsed--;
+  spin_unlock(&mdev->dmaSlotLock);
+}
+
+/**
+ * @brief Frees the buffers of a size class
+ *
+ * @param mdev    Driver device structure
+ * @param chunks  Buffers of the class
+ * @param count   Number of buffers
+ */
+static void pcieuni_dma_class_free(module_dev* mdev, pcieuni_dma_chunk* chunks, int count) {
+  struct pcieuni_buffer_list unused;
+  int i;
+
+  // the buffer list frees the physically contiguous buffers
+  pcieuni_bufferList_init(&unused, mdev->parent_dev);
+  for(i = 0; i < count; i++) {
+    pcieuni_dma_buffer_free(mdev, chunks[i].buffer, chunks[i].pages, &unused);
+  }
+  pcieuni_bufferList_clear(&unused);
+  kfree(chunks);
+}
+
+/**
+ * @brief Allocates the buffers of a size class
+ *
+ * Behind an IOMMU the buffers are contiguous only in IOVA space, otherwise (or if that fails) physically contiguous.
+ * If not all buffers can be allocated, the class keeps the buffers allocated so far.
+ *
+ * @param mdev    Driver device structure
+ * @param size    Size of the buffers
+ * @param count   Number of buffers
+ * @param chunks  Returns the buffers of the class
+ *
+ * @return Number of buffers allocated, 0 if none (nothing is left allocated then)
+ */
+static int pcieuni_dma_class_alloc(module_dev* mdev, unsigned long size, int count, pcieuni_dma_chunk** chunks) {
+  pcieuni_buffer* buffer;
+  int i;
+
+  *chunks = kcalloc(count, sizeof(pcieuni_dma_chunk), GFP_KERNEL);
+  if(!*chunks) return 0;
+
+  for(i = 0; i < count; i++) {
+    buffer = pcieuni_dma_buffer_alloc(mdev, size, &(*chunks)[i].pages);
+    if(IS_ERR(buffer)) break;
+    (*chunks)[i].buffer = buffer;
+  }
+
+  if(!i) {
+    kfree(*chunks);
+    *chunks = 0;
+  }
+  return i;
+}
+
+/**
+ * @brief Checks whether the board already has DMA buffers of a size
+ *
+ * @param mdev  Driver device structure
+ * @param size  Size of the buffers
+ *
+ * @return true if the preallocated buffers or a size class have this size
+ */
+static bool pcieuni_dma_class_exists(module_dev* mdev, unsigned long size) {
+  int i;
+
+  if(mdev->dmaSlotCount && mdev->dmaBufferSize == size) return true;
+  for(i = 0; i < mdev->dmaClassCount; i++) {
+    if(mdev->dmaClasses[i].size == size) return true;
+  }
+  return false;
+}
+
+/**
+ * @brief Adds a size class to the board
+ *
+ * @param mdev    Driver device structure
+ * @param chunks  Buffers of the class
+ * @param size    Size of the buffers
+ * @param count   Number of buffers
+ */
+static void pcieuni_dma_class_add(module_dev* mdev, pcieuni_dma_chunk* chunks, unsigned long size, int count) {
+  int j;
+
+  // keep the classes sorted by size
+  for(j = mdev->dmaClassCount; j > 0 && mdev->dmaClasses[j - 1].size > size; j--) {
+    mdev->dmaClasses[j] = mdev->dmaClasses[j - 1];
+  }
+  mdev->dmaClasses[j].chunks = chunks;
+  mdev->dmaClasses[j].size = size;
+  mdev->dmaClasses[j].count = count;
+  mdev->dmaClassCount++;
+  mdev->dmaClassBuffers += count;
+}
+
+/**
+ * @brief Allocates the additional DMA buffer size classes of a board
+ *
+ * Classes with no buffers, an invalid size or the size of existing buffers are skipped. If not all buffers of a class
+ * can be allocated, e.g. because the memory is too fragmented for large contiguous buffers, the class keeps the
+ * buffers allocated so far and the rest goes into another class of half the size (rounded down to whole pages), down
+ * to 4 kB. The board is still usable without the classes.
+ *
+ * @param mdev     Driver device structure
+ * @param sizesKb  Sizes of the buffers of each class in kB, power of 2 between 4 kB and 4 MB
+ * @param counts   Number of buffers of each class
+ * @param n        Number of classes
+ */
+void pcieuni_dma_classes_create(module_dev* mdev, const unsigned int* sizesKb, const unsigned int* counts, int n) {
+  pcieuni_dma_chunk* chunks;
+  unsigned long size;
+  unsigned int missing;
+  int allocated;
+  int i;
+
+  for(i = 0; i < n && mdev->dmaClassCount < PCIEUNI_DMA_CLASSES; i++) {
+    size = (unsigned long)sizesKb[i] * 1024;
+    if(!counts[i] || counts[i] > USHRT_MAX) continue;
+    if(!is_power_of_2(size) || size < 4 * 1024 || size > 4096 * 1024) continue;
+
+    // buffers of the requested size are already there
+    if(pcieuni_dma_class_exists(mdev, size)) continue;
+
+    for(missing = counts[i]; missing && size >= PCIEUNI_DMA_ALLOC_ALIGN && mdev->dmaClassCount < PCIEUNI_DMA_CLASSES;
+        size = rounddown(size / 2, PCIEUNI_DMA_ALLOC_ALIGN)) {
+      if(pcieuni_dma_class_exists(mdev, size)) continue;
+
+      allocated = pcieuni_dma_class_alloc(mdev, size, missing, &chunks);
+      if(!allocated) continue;
+
+      if(size < (unsigned long)sizesKb[i] * 1024) {
+        printk(KERN_WARNING "pcieuni(%s): allocated %d x %lu kB DMA buffers instead of %u kB\n",
+            mdev->parent_dev->name, allocated, size / 1024, sizesKb[i]);
+      }
+      pcieuni_dma_class_add(mdev, chunks, size, allocated);
+      missing -= allocated;
+    }
+
+    if(missing) {
+      printk(KERN_WARNING "pcieuni(%s): failed to allocate %u of %u x %u kB DMA buffers!\n", mdev->parent_dev->name,
+          missing, counts[i], sizesKb[i]);
+    }
+  }
+}
+
+/**
+ * @brief Frees the additional DMA buffer size classes of a board
+ *
+ * @param mdev  Driver device structure
+ */
+void pcieuni_dma_classes_free(module_dev* mdev) {
+  pcieuni_dma_class* sizeClass;
+
+  while(mdev->dmaClassCount) {
+    sizeClass = &mdev->dmaClasses[--mdev->dmaClassCount];
+    pcieuni_dma_class_free(mdev, sizeClass->chunks, sizeClass->count);
+  }
+  mdev->dmaClassBuffers = 0;
+}
+
+/**
+ * @brief Takes the best fitting free DMA buffer for the next chunk of a DMA read
+ *
+ * The chunk goes into the smallest buffer it fits in, a chunk larger than all buffers into the largest buffer. The
+ * preallocated buffers of the ring are one more size class. If the buffers of the chosen class are all taken the
+ * caller waits for its own chunks in flight instead of splitting the chunk into smaller buffers.
+ * @note Only used with module_dev::dmaReadMutex held.
+ *
+ * @param mdev       Driver device structure
+ * @param dmaSize    Size of the rest of the data to read
+ * @param sizeClass  Returns the index of the class in module_dev::dmaClasses, -1 for the preallocated buffers
+ *
+ * @return Buffer, NULL if no buffer of the chosen class is free or error pointer
+ */
+pcieuni_buffer* pcieuni_dma_get_chunk_buffer(module_dev* mdev, unsigned long dmaSize, int* sizeClass) {
+  int best = -1;
+  unsigned long bestSize = mdev->dmaSlotCount ? mdev->dmaBufferSize : 0;
+  unsigned long size;
+  int i;
+  pcieuni_buffer* buffer = 0;
+  pcieuni_dma_class* chosen;
+
+  for(i = 0; i < mdev->dmaClassCount; i++) {
+    size = mdev->dmaClasses[i].size;
+    // the smallest buffer the chunk fits in, the largest buffer while none fits
+    if(bestSize < dmaSize ? size > bestSize : (size >= dmaSize && size < bestSize)) {
+      best = i;
+      bestSize = size;
+    }
+  }
+
+  if(best < 0) {
+    if(!pcieuni_dma_try_use_buffer(mdev)) return 0;
+    buffer = pcieuni_bufferList_get_free(&mdev->dmaBuffers);
+    if(IS_ERR(buffer)) pcieuni_dma_unuse_buffer(mdev);
+  }
+  else {
+    chosen = &mdev->dmaClasses[best];
+    spin_lock(&mdev->dmaSlotLock);
+    for(i = 0; i < chosen->count && !buffer; i++) {
+      if(chosen->chunks[i].taken) continue;
+      chosen->chunks[i].taken = true;
+      buffer = chosen->chunks[i].buffer;
+    }
+    spin_unlock(&mdev->dmaSlotLock);
+  }
+
+  *sizeClass = best;
+  return buffer;
+}
+
+/**
+ * @brief Returns the entry of a buffer taken with pcieuni_dma_get_chunk_buffer() from a size class
+ *
+ * @param mdev       Driver device structure
+ * @param buffer     Buffer
+ * @param sizeClass  Class the buffer was taken from
+ *
+ * @return Entry of the buffer in the class, NULL if the buffer is not in the class
+ */
+static pcieuni_dma_chunk* pcieuni_dma_find_chunk(module_dev* mdev, pcieuni_buffer* buffer, int sizeClass) {
+  pcieuni_dma_class* owner;
+  int i;
+
+  if(WARN_ON_ONCE(sizeClass >= mdev->dmaClassCount)) return 0;
+
+  owner = &mdev->dmaClasses[sizeClass];
+  for(i = 0; i < owner->count; i++) {
+    if(owner->chunks[i].buffer == buffer) return &owner->chunks[i];
+  }
+
+  WARN_ONCE(1, "pcieuni(%s): DMA buffer %p is not in size class %d\n", mdev->parent_dev->name, buffer, sizeClass);
+  return 0;
+}
+
+/**
+ * @brief Returns a DMA buffer taken with pcieuni_dma_get_chunk_buffer()
+ *
+ * @param mdev       Driver device structure
+ * @param buffer     Buffer
+ * @param sizeClass  Class the buffer was taken from
+ */
+void pcieuni_dma_put_chunk_buffer(module_dev* mdev, pcieuni_buffer* buffer, int sizeClass) {
+  pcieuni_dma_chunk* chunk;
+
+  if(sizeClass < 0) {
+    pcieuni_bufferList_set_free(&mdev->dmaBuffers, buffer);
+    pcieuni_dma_unuse_buffer(mdev);
+    return;
+  }
+
+  chunk = pcieuni_dma_find_chunk(mdev, buffer, sizeClass);
+  if(!chunk) return;
+
+  spin_lock(&mdev->dmaSlotLock);
+  chunk->taken = false;
+  spin_unlock(&mdev->dmaSlotLock);
+}
+
+/**
+ * @brief Syncs a buffer taken with pcieuni_dma_get_chunk_buffer() or a preallocated buffer
+ *
+ * See pcieuni_dma_buffer_sync().
+ *
+ * @param mdev       Driver device structure
+ * @param buffer     Buffer, its first pcieuni_buffer::dma_size bytes hold the transfer
+ * @param sizeClass  Class the buffer was taken from, -1 for the preallocated buffers
+ * @param forDevice  Sync for the device before the transfer, otherwise for the CPU after it
+ */
+void pcieuni_dma_sync_chunk(module_dev* mdev, pcieuni_buffer* buffer, int sizeClass, bool forDevice) {
+  struct sg_table* pages;
+  pcieuni_dma_chunk* chunk;
+
+  if(sizeClass < 0) {
+    pages = mdev->dmaSlots[pcieuni_dma_ring_slot(mdev, buffer)].pages;
+  }
+  else {
+    chunk = pcieuni_dma_find_chunk(mdev, buffer, sizeClass);
+    if(!chunk) return;
+    pages = chunk->pages;
+  }
+  pcieuni_dma_buffer_sync(mdev, buffer, pages, forDevice);
 }
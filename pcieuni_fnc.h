@@ -8,10 +8,18 @@
 #ifndef _PCIEUNI_FNC_H_
 #define _PCIEUNI_FNC_H_
 
+#include "pcieuni_drv_io.h"
 #include <gpcieuni/pcieuni_buffer.h>
 #include <gpcieuni/pcieuni_io.h>
 #include <gpcieuni/pcieuni_ufn.h>
+#include <linux/completion.h>
+#include <linux/hrtimer.h>
+#include <linux/mm_types.h>
+#include <linux/mutex.h>
+#include <linux/scatterlist.h>
 #include <linux/semaphore.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
 
 #define DEVNAME "pcieuni"         /* name of device */
 #define PCIEUNI_VENDOR_ID 0x10EE  /* XILINX vendor ID */
@@ -27,6 +35,190 @@
 #define DMA_BOARD_ADDRESS 0x4
 #define DMA_CPU_ADDRESS 0x8
 #define DMA_SIZE_ADDRESS 0xC
+#define DMA_WR_BOARD_ADDRESS 0x14 /* host to device channel, only used with dma_write=1 */
+#define DMA_WR_CPU_ADDRESS 0x18
+#define DMA_WR_SIZE_ADDRESS 0x1C
+#define DMA_CPU_ADDRESS_HI 0x10    /* upper 32 bits of the host address, only on firmware with 64-bit DMA */
+#define DMA_WR_CPU_ADDRESS_HI 0x20 /* upper 32 bits of the host address of the host to device channel */
+
+/* granularity of DMA buffer sizes: whole pages, each a multiple of the DMA transfer granularity */
+#define PCIEUNI_DMA_ALLOC_ALIGN max_t(unsigned long, PAGE_SIZE, PCIEUNI_DMA_SYZE)
+#define PCIEUNI_DMA_WRITE_BUFFERS 2 /* source buffers of a DMA write, one is filled while the device reads the other */
+
+#define PCIEUNI_STATS_BUCKETS 40 /* number of log2 buckets of latency histograms, the last one is open-ended */
+#define PCIEUNI_DMA_CLASSES 4    /* maximum number of additional DMA buffer size classes of a board */
+
+/**
+ * @brief User pages of a zero-copy DMA read left to the DMA engine after a timeout
+ *
+ * The engine cannot be stopped, so the pages stay pinned and mapped until it finished a later transfer, see
+ * pcieuni_dma_orphan_add().
+ */
+struct pcieuni_dma_orphan {
+  struct list_head list; /**< Entry in module_dev::dmaOrphans or module_dev::dmaOrphansDone */
+  struct sg_table sgt;   /**< DMA mapping of the pages */
+  struct page** pages;   /**< Pinned user pages */
+  unsigned long nPages;  /**< Number of pages */
+};
+typedef struct pcieuni_dma_orphan pcieuni_dma_orphan;
+
+/**
+ * @brief Slot of the mmap-able DMA ring
+ *
+ * Each preallocated DMA buffer is one slot of the ring. While a slot is held by a file the buffer is taken out of the
+ * buffer list, so the regular DMA read does not overwrite the data.
+ */
+struct pcieuni_dma_slot {
+  pcieuni_buffer* buffer; /**< DMA buffer backing the slot */
+  struct sg_table* pages; /**< Pages of a buffer contiguous only in IOVA space, NULL if physically contiguous */
+  struct file* owner;     /**< File holding the slot, NULL if the buffer is in the buffer list or streamed */
+};
+typedef struct pcieuni_dma_slot pcieuni_dma_slot;
+
+/**
+ * @brief Buffer of an additional DMA buffer size class
+ */
+struct pcieuni_dma_chunk {
+  pcieuni_buffer* buffer; /**< DMA buffer */
+  struct sg_table* pages; /**< Pages of a buffer contiguous only in IOVA space, NULL if physically contiguous */
+  bool taken;             /**< The buffer is used by a DMA read, protected by module_dev::dmaSlotLock */
+};
+typedef struct pcieuni_dma_chunk pcieuni_dma_chunk;
+
+/**
+ * @brief Additional size class of DMA buffers used by the regular DMA read
+ *
+ * Besides the preallocated buffers of the ring a board may have buffers of other sizes. Each chunk of a read goes into
+ * the smallest buffer it fits in, see pcieuni_dma_get_chunk_buffer().
+ */
+struct pcieuni_dma_class {
+  pcieuni_dma_chunk* chunks; /**< Buffers of the class */
+  unsigned long size;        /**< Size of the buffers */
+  int count;                 /**< Number of buffers */
+};
+typedef struct pcieuni_dma_class pcieuni_dma_class;
+
+struct module_dev;
+struct pcieuni_dma_xfer;
+
+/**
+ * @brief Completion callback of a DMA transfer no process waits for
+ * @note Called by pcieuni_dma_complete() with module_dev::dmaLock held, so it must not block.
+ */
+typedef void (*pcieuni_dma_done_fn)(struct module_dev* mdev, struct pcieuni_dma_xfer* xfer);
+
+/**
+ * @brief Entry of the DMA engine queue
+ *
+ * Owned by the submitter of the transfer, which keeps it valid until the transfer is finished or cancelled.
+ */
+struct pcieuni_dma_xfer {
+  struct list_head list;      /**< Entry in module_dev::dmaQueue */
+  pcieuni_buffer* buffer;     /**< Target DMA buffer (source buffer of a DMA write) */
+  bool toDevice;              /**< DMA write from the buffer to the device */
+  u64 startNs;                /**< Time the transfer was started on the DMA engine (ktime_get_ns()) */
+  u64 doneNs;                 /**< Time of the end of DMA interrupt (ktime_get_ns()) */
+  pcieuni_dma_done_fn done;   /**< Completion callback, NULL if a process waits for the transfer */
+  struct completion finished; /**< Completed last by pcieuni_dma_complete() if there is no callback */
+};
+typedef struct pcieuni_dma_xfer pcieuni_dma_xfer;
+
+/**
+ * @brief Ring slot filled by the streaming acquisition
+ */
+struct pcieuni_stream_entry {
+  pcieuni_buffer* buffer; /**< DMA buffer of the slot */
+  u32 slot;               /**< Index of the slot in module_dev::dmaSlots */
+  u64 seq;                /**< Sequence number of the read into the slot */
+  u64 doneNs;             /**< Time of the end of DMA interrupt of the read into the slot (ktime_get_ns()) */
+};
+typedef struct pcieuni_stream_entry pcieuni_stream_entry;
+
+/**
+ * @brief Streaming acquisition of a board, see pcieuni_dma_stream.c
+ *
+ * The entries are filled in order. Reads fillSeq - doneSeq are waiting for user space or handed to it, all other
+ * entries are free. Unless noted otherwise the members are protected by module_dev::dmaLock.
+ */
+struct pcieuni_dma_stream {
+  struct mutex mutex;            /**< Serializes start and stop of the stream */
+  struct file* owner;            /**< File that started the stream, NULL if no stream is set up */
+  bool running;                  /**< Reads are re-armed */
+  pcieuni_stream_entry* entries; /**< Slots filled by the stream */
+  u32 nEntries;                  /**< Number of entries */
+  unsigned long devOffset;       /**< DMA offset to read from */
+  unsigned long dmaSize;         /**< Size of each read */
+  u64 periodNs;                  /**< Period of the reads, 0 for back to back */
+  u64 timeoutNs;                 /**< Time a read may take before its interrupt is taken as lost */
+  u64 fillSeq;                   /**< Number of finished reads, the next one goes to entries[fillSeq % nEntries] */
+  u64 readSeq;                   /**< Number of reads handed to user space */
+  u64 doneSeq;                   /**< Number of reads released by user space */
+  bool filling;                  /**< A read is queued or running */
+  bool stalled;                  /**< Back-to-back stream waits for user space to release a slot */
+  u64 overruns;                  /**< Reads skipped because no slot was free or the previous read was not done */
+  pcieuni_dma_xfer xfer;         /**< Queue entry of the running read */
+  struct hrtimer timer;          /**< Period of the reads and watchdog of a missed interrupt */
+  wait_queue_head_t wait;        /**< Woken up when a read is finished or the stream is stopped */
+};
+typedef struct pcieuni_dma_stream pcieuni_dma_stream;
+
+/**
+ * @brief Board memory region read by pcieuni_dma_read_segments()
+ */
+struct pcieuni_dma_segment {
+  unsigned long devOffset; /**< DMA offset to read from */
+  unsigned long dataSize;  /**< Size of data to be read */
+  void __user* userBuffer; /**< Target user-space buffer */
+  void* kernelBuffer;      /**< Target kernel buffer, used instead of userBuffer if not NULL */
+};
+typedef struct pcieuni_dma_segment pcieuni_dma_segment;
+
+/**
+ * @brief Per-board DMA statistics
+ *
+ * All members are updated with atomic operations only, so the statistics need no locking in the DMA path.
+ */
+struct pcieuni_dma_stats {
+  atomic64_t transfers;                          /**< Finished DMA transfers */
+  atomic64_t bytes;                              /**< Bytes transferred by finished DMA transfers */
+  atomic64_t timeouts;                           /**< DMA reads that timed out waiting for the interrupt */
+  atomic64_t writeTimeouts;                      /**< DMA writes that timed out waiting for the interrupt */
+  atomic64_t irqUnexpected;                      /**< Interrupts without a running DMA transfer */
+  atomic64_t irqMissed;                          /**< Lost end of DMA interrupts made up for by the status register */
+  atomic64_t queueWaits;                         /**< DMA transfers that had to wait for the DMA engine */
+  atomic64_t copies;                             /**< Copies of DMA data to user space */
+  atomic64_t copyNs;                             /**< Total time spent copying DMA data to user space */
+  atomic64_t busyPolls;                          /**< DMA transfers whose completion was caught by busy-polling */
+  atomic64_t mergedReads;                        /**< DMA reads served from the result of an identical read */
+  atomic64_t streamOverruns;                     /**< Reads of the streaming acquisition skipped by overruns */
+  atomic64_t dmaLatency[PCIEUNI_STATS_BUCKETS];  /**< Histogram of start of DMA to interrupt */
+  atomic64_t wakeLatency[PCIEUNI_STATS_BUCKETS]; /**< Histogram of interrupt to waiting process running */
+};
+typedef struct pcieuni_dma_stats pcieuni_dma_stats;
+
+/**
+ * @brief Adds a latency to a log2 histogram of pcieuni_dma_stats
+ *
+ * @param hist  Target histogram
+ * @param ns    Latency in ns
+ */
+static inline void pcieuni_stats_hist_add(atomic64_t* hist, u64 ns) {
+  atomic64_inc(&hist[min_t(int, fls64(ns), PCIEUNI_STATS_BUCKETS - 1)]);
+}
+
+/**
+ * @brief Asynchronous DMA read request
+ */
+struct pcieuni_dma_request {
+  struct list_head list;    /**< Entry in module_dev::asyncQueue or module_dev::asyncDone */
+  struct file* owner;       /**< File that submitted the request or NULL if the file was closed */
+  u32 id;                   /**< Request id returned to user space */
+  unsigned long dma_offset; /**< DMA offset to read from */
+  unsigned long dataSize;   /**< Size of data requested by user space */
+  pcieuni_buffer* buffer;   /**< DMA buffer holding the data once the request is finished */
+  int status;               /**< Request result (0 or negative error code) */
+};
+typedef struct pcieuni_dma_request pcieuni_dma_request;
 
 /**
  * @brief Driver specific part of PCI device structure
@@ -35,26 +227,181 @@ struct module_dev {
   int brd_num; /**< PCI board number */
 
   struct pcieuni_buffer_list dmaBuffers; /**< List of preallocated DMA buffers */
+  pcieuni_dma_slot* dmaSlots;            /**< Preallocated DMA buffers indexed as slots of the mmap-able ring */
+  int dmaSlotCount;                      /**< Number of entries in dmaSlots */
+  int dmaBuffersUsed;                    /**< Number of buffers taken out of the buffer list */
+  int dmaBuffersHeld;                    /**< Number of buffers held by ring slots and asynchronous requests */
+  unsigned long dmaSlotSize;             /**< Size of one ring slot in the mapping (page aligned) */
+  unsigned long dmaBufferSize;           /**< Size of the preallocated DMA buffers */
+  int dmaRingMaps;                       /**< Number of user-space mappings of the DMA ring */
+  bool dmaPoolResizing;                  /**< Buffers are being replaced, see pcieuni_dma_pool_resize() */
+  spinlock_t dmaSlotLock;                /**< Protects slots, buffer accounting and ring mappings */
+
+  pcieuni_dma_class dmaClasses[PCIEUNI_DMA_CLASSES]; /**< Additional buffer size classes, ascending by size */
+  int dmaClassCount;                                 /**< Number of entries in dmaClasses */
+  int dmaClassBuffers;                               /**< Number of buffers in all size classes */
+
+  struct list_head asyncQueue;             /**< Submitted asynchronous DMA requests waiting for the DMA engine */
+  struct list_head asyncDone;              /**< Finished asynchronous DMA requests waiting to be collected */
+  struct pcieuni_dma_request* asyncActive; /**< Asynchronous DMA request being processed */
+  u32 asyncNextId;                         /**< Id of the next submitted asynchronous DMA request */
+  spinlock_t asyncLock;                    /**< Protects asynchronous DMA request lists */
+  struct work_struct asyncWork;            /**< Processes the asynchronous DMA request queue */
+  wait_queue_head_t asyncWait;             /**< Woken up when an asynchronous DMA request is finished */
 
   struct timespec64 dma_start_time;
   struct timespec64 dma_stop_time;
-  int waitFlag;               /**< Locks access to PCI device DMA read process */
-  wait_queue_head_t waitDMA;  /**< Wait queue for DMA read process to finish  */
-  struct semaphore dma_sem;   /**< Semaphore that protects against concurrent acquisition DMA read process */
-  pcieuni_buffer* dma_buffer; /**< DMA buffer used by current/last DMA read process */
+  spinlock_t dmaLock;            /**< Protects the DMA engine state and queue, taken from interrupt handler */
+  struct list_head dmaQueue;     /**< DMA transfers waiting for the DMA engine */
+  struct list_head triggerArmed; /**< DMA reads waiting for the trigger, see pcieuni_dma_trigger.c */
+  pcieuni_buffer* dma_buffer;    /**< DMA buffer used by current DMA read process, NULL if the DMA engine is idle */
+  struct mutex dmaReadMutex;     /**< Serializes DMA reads through the preallocated buffers */
+  pcieuni_dma_xfer* dma_xfer;    /**< Queue entry of the current DMA read process */
+  u64 dmaStartNs;                /**< Start of the current DMA read process (ktime_get_ns()) */
+  bool dmaIrqPending;            /**< End of DMA interrupt received, completion not yet processed by the IRQ thread */
+  u64 dmaIrqNs;                  /**< Time of the end of DMA interrupt (ktime_get_ns()) */
+
+  int irq;                           /**< Linux interrupt number of the board, 0 if not requested */
+  bool irqVectors;                   /**< Interrupt vectors were allocated by this driver */
+  const struct cpumask* irqAffinity; /**< CPUs the interrupt is steered to, NULL if not set by this driver */
+  bool irqExclusive;                 /**< The interrupt is not shared, every interrupt is from this board */
+
+  bool dmaAddr64; /**< The firmware takes 64-bit host addresses, the DMA mask of the board is 64 bits */
+
+  struct list_head eventSubs;  /**< Files subscribed to device events, see pcieuni_events.c */
+  spinlock_t eventLock;        /**< Protects event state and subscriptions, taken from interrupt handler */
+  u64 eventCount;              /**< Number of device events */
+  u64 eventNs;                 /**< Time of the last device event (ktime_get_ns()) */
+  bool eventPending;           /**< Device event recorded, subscribers not yet notified by the IRQ thread */
+  wait_queue_head_t eventWait; /**< Woken up on device events */
+
+  int node;            /**< NUMA node of the board (NUMA_NO_NODE if unknown) */
+  int dmaBuffersLocal; /**< Number of preallocated DMA buffers on the NUMA node of the board */
+
+  pcieuni_dma_stream stream; /**< Streaming acquisition, see pcieuni_dma_stream.c */
+
+  struct mutex dmaShareMutex;         /**< Protects dmaShare */
+  struct pcieuni_dma_share* dmaShare; /**< Result of the last merged DMA read, see pcieuni_dma_merge.c */
+
+  pcieuni_dma_stats stats;   /**< DMA statistics, see pcieuni_dma_stats.c */
+  struct dentry* debugfsDir; /**< debugfs directory of the board */
+
+  spinlock_t dmaOrphanLock;         /**< Protects dmaOrphans and dmaOrphansDone, taken from interrupt handler */
+  struct list_head dmaOrphans;      /**< Timed out zero-copy reads the DMA engine may still write to */
+  struct list_head dmaOrphansDone;  /**< Timed out zero-copy reads to be freed by dmaOrphanWork */
+  struct work_struct dmaOrphanWork; /**< Unmaps and unpins the pages of dmaOrphansDone */
+  bool dmaStopped;                  /**< No transfer is queued any more, see pcieuni_dma_stop() and dmaLock */
 
   struct pcieuni_dev* parent_dev; /**< Universal driver part of the parent PCI device structure */
 };
 typedef struct module_dev module_dev;
 
 /* Driver specific utility functions */
-module_dev* pcieuni_create_mdev(int brd_num, pcieuni_dev* pcidev, unsigned long bufferSize);
+module_dev* pcieuni_create_mdev(int brd_num, pcieuni_dev* pcidev, unsigned long bufferSize, ushort nBuffers);
 void pcieuni_release_mdev(module_dev* mdev);
 module_dev* pcieuni_get_mdev(struct pcieuni_dev* dev);
 
 long pcieuni_ioctl_dma(struct file*, unsigned int*, unsigned long*, pcieuni_cdev*);
 
-int pcieuni_dma_reserve(module_dev* dev, pcieuni_buffer* buffer);
+int pcieuni_dma_queue(module_dev* mdev, pcieuni_buffer* buffer, pcieuni_dma_xfer* xfer);
+int pcieuni_dma_queue_locked(module_dev* mdev, pcieuni_buffer* buffer, pcieuni_dma_xfer* xfer);
+void pcieuni_dma_complete(module_dev* mdev, u64 irqNs);
 void pcieuni_dma_release(module_dev* mdev);
+void pcieuni_dma_cancel(module_dev* mdev, pcieuni_buffer* buffer);
+void pcieuni_dma_cancel_locked(module_dev* mdev, pcieuni_buffer* buffer);
+void pcieuni_dma_orphan_add(module_dev* mdev, pcieuni_dma_orphan* orphan);
+void pcieuni_dma_orphans_done(module_dev* mdev);
+int pcieuni_dma_watchdog(module_dev* mdev, pcieuni_dma_xfer* xfer, u64 timeoutNs);
+int pcieuni_dma_watchdog_locked(module_dev* mdev, pcieuni_dma_xfer* xfer, u64 timeoutNs);
+void pcieuni_dma_stop(module_dev* mdev);
+bool pcieuni_dma_pool_size_valid(unsigned long bufferSize);
+int pcieuni_dma_pool_resize(module_dev* mdev, unsigned long bufferSize, unsigned int nBuffers);
+int pcieuni_dma_hold_buffer(module_dev* mdev);
+void pcieuni_dma_unhold_buffer(module_dev* mdev);
+bool pcieuni_dma_try_use_buffer(module_dev* mdev);
+void pcieuni_dma_unuse_buffer(module_dev* mdev);
+void pcieuni_dma_classes_create(module_dev* mdev, const unsigned int* sizesKb, const unsigned int* counts, int n);
+void pcieuni_dma_classes_free(module_dev* mdev);
+pcieuni_buffer* pcieuni_dma_get_chunk_buffer(module_dev* mdev, unsigned long dmaSize, int* sizeClass);
+void pcieuni_dma_sync_chunk(module_dev* mdev, pcieuni_buffer* buffer, int sizeClass, bool forDevice);
+void pcieuni_dma_put_chunk_buffer(module_dev* mdev, pcieuni_buffer* buffer, int sizeClass);
+
+u64 pcieuni_dma_timeout_ns(module_dev* mdev, unsigned long dmaSize);
+bool pcieuni_dma_status_available(module_dev* mdev);
+int pcieuni_dma_engine_status(module_dev* mdev);
+int pcieuni_dma_program(pcieuni_dev* dev, pcieuni_buffer* targetBuffer, bool toDevice);
+int pcieuni_start_dma_read(pcieuni_dev* dev, pcieuni_buffer* targetBuffer, pcieuni_dma_xfer* xfer);
+int pcieuni_start_dma_write(pcieuni_dev* dev, pcieuni_buffer* sourceBuffer, pcieuni_dma_xfer* xfer);
+int pcieuni_wait_dma_read(module_dev* mdev, pcieuni_dma_xfer* xfer);
+int pcieuni_wait_dma_write(module_dev* mdev, pcieuni_dma_xfer* xfer);
+pcieuni_buffer* pcieuni_dma_read_to_buffer(pcieuni_dev* dev, unsigned long devOffset, unsigned long dataSize);
+int pcieuni_dma_read_segments(
+    pcieuni_dev* dev, pcieuni_dma_segment* segments, int nSegments, pcieuni_dma_timestamps* ts);
+int pcieuni_dma_read_ts(pcieuni_dev* dev, unsigned long devOffset, unsigned long dataSize, void* userBuffer,
+    pcieuni_dma_timestamps* ts);
+int pcieuni_dma_read(pcieuni_dev* dev, unsigned long devOffset, unsigned long dataSize, void* userBuffer);
+int pcieuni_dma_read_sg(pcieuni_dev* dev, const pcieuni_dma_sg_entry __user* userEntries, u32 count);
+int pcieuni_dma_write(pcieuni_dev* dev, unsigned long devOffset, unsigned long dataSize, const void __user* userBuffer);
+
+/* merging of identical DMA reads */
+int pcieuni_dma_read_merged(pcieuni_dev* dev, unsigned long devOffset, unsigned long dataSize, void* userBuffer);
+void pcieuni_dma_merge_cleanup(module_dev* mdev);
+
+/* mmap-able DMA ring */
+int pcieuni_dma_ring_mmap(module_dev* mdev, struct vm_area_struct* vma);
+int pcieuni_dma_ring_read(pcieuni_dev* dev, struct file* filp, unsigned long devOffset, unsigned long dataSize,
+    u32* slot, u64* slotOffset);
+int pcieuni_dma_ring_release(module_dev* mdev, struct file* filp, u32 slot);
+void pcieuni_dma_ring_release_file(module_dev* mdev, struct file* filp);
+int pcieuni_dma_ring_slot(module_dev* mdev, pcieuni_buffer* buffer);
+
+/* Streaming acquisition */
+void pcieuni_dma_stream_init(module_dev* mdev);
+void pcieuni_dma_stream_cleanup(module_dev* mdev);
+int pcieuni_dma_stream_start(module_dev* mdev, struct file* filp, pcieuni_stream_config* config);
+int pcieuni_dma_stream_stop(module_dev* mdev, struct file* filp);
+int pcieuni_dma_stream_next(module_dev* mdev, struct file* filp, pcieuni_stream_slot* slot);
+int pcieuni_dma_stream_release(module_dev* mdev, struct file* filp);
+void pcieuni_dma_stream_release_file(module_dev* mdev, struct file* filp);
+__poll_t pcieuni_dma_stream_poll(module_dev* mdev, struct file* filp, struct poll_table_struct* wait);
+
+/* Asynchronous DMA read */
+int pcieuni_dma_async_init_module(void);
+void pcieuni_dma_async_cleanup_module(void);
+void pcieuni_dma_async_init(module_dev* mdev);
+void pcieuni_dma_async_cleanup(module_dev* mdev);
+int pcieuni_dma_async_submit(module_dev* mdev, struct file* filp, unsigned long devOffset, unsigned long dataSize,
+    u32* id);
+int pcieuni_dma_async_collect(module_dev* mdev, struct file* filp, pcieuni_dma_result* result);
+__poll_t pcieuni_dma_async_poll(module_dev* mdev, struct file* filp, struct poll_table_struct* wait);
+void pcieuni_dma_async_release_file(module_dev* mdev, struct file* filp);
+
+/* Batched register access */
+int pcieuni_reg_run_batch(pcieuni_dev* dev, pcieuni_reg_op __user* userOps, u32 count);
+
+/* BAR mmap */
+bool pcieuni_bar_mmap_requested(struct vm_area_struct* vma);
+int pcieuni_bar_mmap(pcieuni_dev* dev, struct vm_area_struct* vma);
+
+/* Trigger-armed DMA read */
+void pcieuni_dma_trigger_fire(module_dev* mdev, u64 irqNs);
+int pcieuni_dma_read_triggered(pcieuni_dev* dev, unsigned long devOffset, unsigned long dataSize,
+    void __user* userBuffer, u32 timeoutMs, u64* triggerNs, u64* irqNs);
+
+/* Device events */
+void pcieuni_events_init(module_dev* mdev);
+void pcieuni_events_cleanup(module_dev* mdev);
+void pcieuni_events_record(module_dev* mdev, u64 irqNs);
+void pcieuni_events_notify(module_dev* mdev);
+int pcieuni_events_subscribe(module_dev* mdev, struct file* filp, int eventfd);
+void pcieuni_events_release_file(module_dev* mdev, struct file* filp);
+int pcieuni_events_read(module_dev* mdev, struct file* filp, pcieuni_event* event);
+__poll_t pcieuni_events_poll(module_dev* mdev, struct file* filp, struct poll_table_struct* wait);
+
+/* DMA statistics */
+void pcieuni_stats_init_module(void);
+void pcieuni_stats_cleanup_module(void);
+void pcieuni_stats_add(module_dev* mdev);
+void pcieuni_stats_remove(module_dev* mdev);
 
 #endif /* _PCIEUNI_FNC_H_ */
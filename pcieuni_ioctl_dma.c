@@ -4,35 +4,217 @@
  */
 
 #include "pcieuni_fnc.h"
+#include "pcieuni_trace.h"
 #include <gpcieuni/pcieuni_buffer.h>
+#include <linux/dma-mapping.h>
 #include <linux/kernel.h>
+#include <linux/math64.h>
+#include <linux/mm.h>
+#include <linux/module.h>
 #include <linux/pagemap.h>
+#include <linux/scatterlist.h>
 #include <linux/sched.h>
+#include <linux/slab.h>
 #include <linux/types.h>
+#include <linux/version.h>
 
 #ifdef PCIEUNI_DEBUG
 static atomic_t dma_request_counter = ATOMIC_INIT(0);
 #endif
 
+/**
+ * @brief Module parameter - minimum size of DMA read (in kB) that is transferred directly into the user buffer
+ *
+ * Reads of at least this size into a page aligned user buffer bypass the driver buffers. Set to 0 to disable.
+ */
+static unsigned long zero_copy_min_sz_kb = 64;
+module_param(zero_copy_min_sz_kb, ulong, S_IRUGO | S_IWUSR);
+
+/**
+ * @brief Module parameter - maximum size of DMA transfer (in kB) whose completion is busy-polled
+ *
+ * The waiting process spins for up to busy_poll_us instead of sleeping until the end of DMA interrupt wakes it up.
+ * Set to 0 to disable.
+ */
+static unsigned long busy_poll_max_sz_kb = 0;
+module_param(busy_poll_max_sz_kb, ulong, S_IRUGO | S_IWUSR);
+
+/**
+ * @brief Module parameter - maximum time (in us) to busy-poll for DMA completion before sleeping
+ */
+static unsigned int busy_poll_us = 50;
+module_param(busy_poll_us, uint, S_IRUGO | S_IWUSR);
+
+/**
+ * @brief Module parameter - firmware has the host to device DMA channel (DMA_WR_* registers)
+ *
+ * PCIEUNI_DMA_WRITE fails with -EOPNOTSUPP unless this is set.
+ */
+static bool dma_write = false;
+module_param(dma_write, bool, S_IRUGO);
+
+/**
+ * @brief Module parameter - minimum time (in ms) to wait for the end of DMA interrupt
+ *
+ * 0 = 1000 ms, or 20 ms with ::dma_status_reg. After a timeout the buffer is reused although the device may still
+ * write into it, so without the status register the timeout must cover a loaded host.
+ */
+static unsigned int dma_timeout_ms = 0;
+module_param(dma_timeout_ms, uint, S_IRUGO | S_IWUSR);
+
+/**
+ * @brief Module parameter - slowest expected DMA rate (in MB/s)
+ *
+ * The time a transfer takes at this rate is added to ::dma_timeout_ms. Set to 0 to use ::dma_timeout_ms only.
+ */
+static unsigned int dma_timeout_rate_mbs = 100;
+module_param(dma_timeout_rate_mbs, uint, S_IRUGO | S_IWUSR);
+
+/**
+ * @brief Module parameter - offset in BAR 2 of a DMA status register, -1 if the firmware has none
+ *
+ * With the status register a lost end of DMA interrupt is detected within a quarter of the DMA timeout and the
+ * transfer is finished anyway, and an interrupt arriving while the DMA engine is busy is not taken for its end.
+ * Device events and trigger-armed reads are only available with the status register.
+ */
+static int dma_status_reg = -1;
+module_param(dma_status_reg, int, S_IRUGO | S_IWUSR);
+
+/**
+ * @brief Module parameter - bits of ::dma_status_reg that tell whether the device to host DMA is done
+ */
+static unsigned int dma_status_mask = 0;
+module_param(dma_status_mask, uint, S_IRUGO | S_IWUSR);
+
+/**
+ * @brief Module parameter - value of the ::dma_status_mask bits when the device to host DMA is done
+ */
+static unsigned int dma_status_done = 0;
+module_param(dma_status_done, uint, S_IRUGO | S_IWUSR);
+
+/**
+ * @brief Returns the time to wait for the end of DMA interrupt of a transfer
+ *
+ * @param mdev     Driver device structure
+ * @param dmaSize  Size of the transfer
+ *
+ * @return Timeout in ns, counted from the start of the transfer on the DMA engine
+ */
+u64 pcieuni_dma_timeout_ns(module_dev* mdev, unsigned long dmaSize) {
+  unsigned int timeoutMs = dma_timeout_ms;
+  u64 timeoutNs;
+  unsigned int rateMBs = dma_timeout_rate_mbs;
+
+  if(!timeoutMs) timeoutMs = pcieuni_dma_status_available(mdev) ? 20 : 1000;
+  timeoutNs = (u64)timeoutMs * NSEC_PER_MSEC;
+
+  // 1 MB/s is 1 byte per us
+  if(rateMBs) timeoutNs += div_u64((u64)dmaSize * NSEC_PER_USEC, rateMBs);
+  return max_t(u64, timeoutNs, NSEC_PER_MSEC);
+}
+
+/**
+ * @brief Checks whether ::dma_status_reg is set and inside the DMA register BAR of the board
+ *
+ * Without the status register an interrupt arriving while a DMA read is running can not be told apart from its end of
+ * DMA interrupt, so device events and trigger-armed reads are only offered with it.
+ *
+ * @param mdev  Driver device structure
+ *
+ * @return true if the status of a DMA read can be read from the board
+ */
+bool pcieuni_dma_status_available(module_dev* mdev) {
+  pcieuni_dev* dev = mdev->parent_dev;
+  int reg = READ_ONCE(dma_status_reg);
+
+  if(reg < 0 || reg % 4 || !dev->memmory_base2) return false;
+  return (resource_size_t)reg + 4 <= pci_resource_len(dev->pcieuni_pci_dev, 2);
+}
+
+/**
+ * @brief Reads the status of the running DMA transfer from ::dma_status_reg
+ * @note Called with module_dev::dmaLock held while a transfer is running, also from the top-half interrupt handler.
+ *
+ * @param mdev  Driver device structure
+ *
+ * @retval 1   The transfer is done
+ * @retval 0   The transfer is running
+ * @retval -1  Unknown: no status register or the transfer is a DMA write
+ */
+int pcieuni_dma_engine_status(module_dev* mdev) {
+  int reg = READ_ONCE(dma_status_reg);
+
+  if(!mdev->dma_xfer || mdev->dma_xfer->toDevice || !pcieuni_dma_status_available(mdev)) return -1;
+
+  return (ioread32(mdev->parent_dev->memmory_base2 + reg) & dma_status_mask) == dma_status_done;
+}
+
+/**
+ * @brief Programs the DMA engine registers and starts DMA transfer
+ *
+ * The DMA transfer size and offset are taken from the target buffer structure.
+ * @note This function is called with module_dev::dmaLock held, so it must not block.
+ *
+ * @param dev          Traget device structure
+ * @param targetBuffer Target buffer (source buffer of a DMA write)
+ * @param toDevice     Program the host to device channel instead of the device to host channel
+ *
+ * @return   0       Success
+ * @retval   -EIO    Failed to write to device registers or the buffer is out of reach of the DMA engine
+ */
+int pcieuni_dma_program(pcieuni_dev* dev, pcieuni_buffer* targetBuffer, bool toDevice) {
+  int retVal = 0;
+  struct module_dev* mdev = pcieuni_get_mdev(dev);
+
+  // the 32-bit DMA mask keeps the addresses low, this only catches a buffer mapped around it
+  if(!mdev->dmaAddr64 && upper_32_bits(targetBuffer->dma_handle)) return -EIO;
+
+  // write DMA board address to device register
+  retVal = pcieuni_register_write32(dev, dev->memmory_base2, toDevice ? DMA_WR_BOARD_ADDRESS : DMA_BOARD_ADDRESS,
+      targetBuffer->dma_offset, false);
+  if(retVal) return retVal;
+
+  // write upper half of DMA host address to device register, the lower half below completes the address
+  if(mdev->dmaAddr64) {
+    retVal = pcieuni_register_write32(dev, dev->memmory_base2, toDevice ? DMA_WR_CPU_ADDRESS_HI : DMA_CPU_ADDRESS_HI,
+        upper_32_bits(targetBuffer->dma_handle), false);
+    if(retVal) return retVal;
+  }
+
+  // write DMA host address to device register
+  retVal = pcieuni_register_write32(dev, dev->memmory_base2, toDevice ? DMA_WR_CPU_ADDRESS : DMA_CPU_ADDRESS,
+      lower_32_bits(targetBuffer->dma_handle), true);
+  if(retVal) return retVal;
+
+  // write DMA size and start DMA
+  retVal = pcieuni_register_write32(dev, dev->memmory_base2, toDevice ? DMA_WR_SIZE_ADDRESS : DMA_SIZE_ADDRESS,
+      targetBuffer->dma_size, false);
+  if(retVal) return retVal;
+
+  PDEBUG(dev->name, "pcieuni_dma_program(): DMA started, offset=0x%lx, size=0x%lx \n", targetBuffer->dma_offset,
+      targetBuffer->dma_size);
+
+  return 0;
+}
+
 /**
  * @brief Initiates DMA read from device
  *
  * This function will initiate DMA read from device into the target buffer. The DMA transfer size and offset are taken
  * from the target buffer structure. The target buffer is expected to be already synched for device access.
- * In case the device is busy this fuction will block. Once the DMA transfer is initiated the function will return immediately.
- * @note This function may block.
+ * In case the device is busy the transfer is queued and started from the interrupt handler as soon as the transfers
+ * queued before it are finished. The function returns immediately in both cases.
  *
  * @param dev          Traget device structure
  * @param targetBuffer Target buffer
+ * @param xfer         Queue entry for the transfer, must stay valid until the transfer is finished or cancelled
  *
  * @return   0       Success
  * @retval   -EBUSY  Cannot initiate DMA because target device is busy
- * @retval   -EINTR  Operation was interupted
  * @retval   -EIO    Failed to write to device registers
  */
-int pcieuni_start_dma_read(pcieuni_dev* dev, pcieuni_buffer* targetBuffer) {
+int pcieuni_start_dma_read(pcieuni_dev* dev, pcieuni_buffer* targetBuffer, pcieuni_dma_xfer* xfer) {
   struct module_dev* mdev = pcieuni_get_mdev(dev);
-  int retVal = 0;
 
 #ifdef PCIEUNI_DEBUG
   atomic_inc(&dma_request_counter);
@@ -41,97 +223,382 @@ int pcieuni_start_dma_read(pcieuni_dev* dev, pcieuni_buffer* targetBuffer) {
       targetBuffer->dma_size, atomic_read(&dma_request_counter));
 #endif /*PCIEUNI_DEBUG*/
 
-  // reserve device registers IO
-  retVal = pcieuni_dma_reserve(mdev, targetBuffer);
-  if(retVal) return retVal;
-
-  // write DMA source address to device register
-  retVal = pcieuni_register_write32(dev, dev->memmory_base2, DMA_BOARD_ADDRESS, targetBuffer->dma_offset, false);
-  if(retVal) goto cleanup_releaseDevice;
-
-  // write DMA destination address to device register
-  retVal = pcieuni_register_write32(
-      dev, dev->memmory_base2, DMA_CPU_ADDRESS, (u32)(targetBuffer->dma_handle & 0xFFFFFFFF), true);
-  if(retVal) goto cleanup_releaseDevice;
-
-  ktime_get_real_ts64(&(mdev->dma_start_time));
-
-  // Setup env for irq handler
-  mdev->waitFlag = 0;
-  mdev->dma_buffer = targetBuffer;
-
-  // write DMA size and start DMA
-  retVal = pcieuni_register_write32(dev, dev->memmory_base2, DMA_SIZE_ADDRESS, targetBuffer->dma_size, false);
-  if(retVal) goto cleanup_releaseDevice;
+  xfer->toDevice = false;
+  xfer->done = 0;
+  init_completion(&xfer->finished);
+  return pcieuni_dma_queue(mdev, targetBuffer, xfer);
+}
 
-  PDEBUG(dev->name, "pcieuni_start_dma_read(): DMA started, offset=0x%lx, size=0x%lx \n", targetBuffer->dma_offset,
-      targetBuffer->dma_size);
+/**
+ * @brief Initiates DMA write to device
+ *
+ * Same as pcieuni_start_dma_read() in the other direction: the device reads dma_size bytes from the source buffer at
+ * dma_handle and writes them to dma_offset. The source buffer is expected to be already mapped for device access.
+ *
+ * @param dev          Traget device structure
+ * @param sourceBuffer Source buffer
+ * @param xfer         Queue entry for the transfer, must stay valid until the transfer is finished or cancelled
+ *
+ * @return   0       Success
+ * @retval   -EBUSY  Cannot initiate DMA because target device is busy
+ * @retval   -EIO    Failed to write to device registers
+ */
+int pcieuni_start_dma_write(pcieuni_dev* dev, pcieuni_buffer* sourceBuffer, pcieuni_dma_xfer* xfer) {
+  struct module_dev* mdev = pcieuni_get_mdev(dev);
 
-cleanup_releaseDevice:
-  if(retVal) {
-    // release device registers IO
-    pcieuni_dma_release(mdev);
-  }
+  PDEBUG(dev->name, "pcieuni_start_dma_write(offset=0x%lx, size=0x%lx)\n", sourceBuffer->dma_offset,
+      sourceBuffer->dma_size);
 
-  return retVal;
+  xfer->toDevice = true;
+  xfer->done = 0;
+  init_completion(&xfer->finished);
+  return pcieuni_dma_queue(mdev, sourceBuffer, xfer);
 }
 
 /**
- * @brief Waits until DMA read to target buffer is finished
+ * @brief Waits until DMA transfer to or from a driver buffer is finished
+ *
+ * The process sleeps on the completion of its own transfer, so finishing a transfer wakes only the process waiting
+ * for it and not every process with a transfer in the DMA queue. The timeout scales with the transfer size, see
+ * pcieuni_dma_timeout_ns(), and starts when the transfer is started on the DMA engine. Timeouts of DMA writes are
+ * counted separately from those of DMA reads.
  * @note This function may block.
  *
  * @param mdev   Target device
- * @param buffer Target driver buffer
+ * @param xfer   Queue entry of the transfer
  *
  * @retval 0            Success
  * @retval -EIO         Timed out while waiting for end of DMA IRQ
- * @retval -EINTR       Interrupted while waiting for end of DMA IRQ
  */
-int pcieuni_wait_dma_read(module_dev* mdev, pcieuni_buffer* buffer) {
+static int pcieuni_wait_dma(module_dev* mdev, pcieuni_dma_xfer* xfer) {
   int code;
-  ulong timeout = HZ / 1; // Timeout in 1 second
+  bool slept = false;
+  u64 pollEnd;
+  pcieuni_buffer* buffer = xfer->buffer;
+  u64 timeoutNs = pcieuni_dma_timeout_ns(mdev, buffer->dma_size);
+  unsigned long slice = max(nsecs_to_jiffies(timeoutNs / 4), 1UL);
 
-  PDEBUG(
-      mdev->parent_dev->name, "pcieuni_wait_dma_read(offset=0x%lx, size=0x%lx)", buffer->dma_offset, buffer->dma_size);
-  while(test_bit(BUFFER_STATE_WAITING, &buffer->state)) {
+  PDEBUG(mdev->parent_dev->name, "pcieuni_wait_dma(offset=0x%lx, size=0x%lx)", buffer->dma_offset, buffer->dma_size);
+
+  // small transfers finish within microseconds - spinning avoids the cost of sleeping and being woken up
+  if(buffer->dma_size <= busy_poll_max_sz_kb * 1024) {
+    pollEnd = ktime_get_ns() + (u64)busy_poll_us * NSEC_PER_USEC;
+    while(!completion_done(&xfer->finished) && ktime_get_ns() < pollEnd) {
+      cpu_relax();
+    }
+    if(completion_done(&xfer->finished)) atomic64_inc(&mdev->stats.busyPolls);
+  }
+
+  // the buffer state is cleared before the interrupt thread is done with the transfer, only the completion tells
+  if(!completion_done(&xfer->finished)) {
     // DMA not finished yet - wait for IRQ handler
-    PDEBUG(mdev->parent_dev->name, "pcieuni_wait_dma_read(offset=0x%lx, size=0x%lx): Waiting... \n", buffer->dma_offset,
+    PDEBUG(mdev->parent_dev->name, "pcieuni_wait_dma(offset=0x%lx, size=0x%lx): Waiting... \n", buffer->dma_offset,
         buffer->dma_size);
 
-    code = wait_event_timeout(mdev->waitDMA, !test_bit(BUFFER_STATE_WAITING, &buffer->state), timeout);
-    if(code == 0) {
-      printk(KERN_ERR "pcieuni(%s): error waiting for DMA to buffer (offset=0x%lx, size=0x%lx): TIMEOUT!\n",
-          mdev->parent_dev->name, buffer->dma_offset, buffer->dma_size);
+    slept = true;
+    // look after the transfer every quarter of its timeout, a lost interrupt may be made up for by the status register
+    while(!wait_for_completion_timeout(&xfer->finished, slice)) {
+      code = pcieuni_dma_watchdog(mdev, xfer, timeoutNs);
+      if(code == -EAGAIN) continue;
+      if(!code) break;
 
-      // assuming we missed the interrupt
-      pcieuni_dma_release(mdev);
-      return -EIO;
-    }
-    else if(code < 0) {
-      printk(KERN_ERR "pcieuni(%s): error waiting for DMA to buffer (offset=0x%lx, size=0x%lx): errno=%d!\n",
-          mdev->parent_dev->name, buffer->dma_offset, buffer->dma_size, code);
+      printk(KERN_ERR "pcieuni(%s): error waiting for DMA %s buffer (offset=0x%lx, size=0x%lx): TIMEOUT!\n",
+          mdev->parent_dev->name, xfer->toDevice ? "from" : "to", buffer->dma_offset, buffer->dma_size);
+      atomic64_inc(xfer->toDevice ? &mdev->stats.writeTimeouts : &mdev->stats.timeouts);
 
       // assuming we missed the interrupt
-      pcieuni_dma_release(mdev);
-      return -EINTR;
+      pcieuni_dma_cancel(mdev, buffer);
+      return -EIO;
     }
   }
 
-  PDEBUG(mdev->parent_dev->name, "pcieuni_wait_dma_read(offset=0x%lx, size=0x%lx): Done!", buffer->dma_offset,
+  PDEBUG(mdev->parent_dev->name, "pcieuni_wait_dma(offset=0x%lx, size=0x%lx): Done!", buffer->dma_offset,
       buffer->dma_size);
 
+  trace_pcieuni_dma_wakeup(mdev->brd_num, buffer, buffer->dma_offset, buffer->dma_size);
+
+  // wake-up latency is only meaningful if the interrupt came while we were sleeping
+  if(slept) pcieuni_stats_hist_add(mdev->stats.wakeLatency, ktime_get_ns() - xfer->doneNs);
+
   ktime_get_real_ts64(&(mdev->dma_stop_time));
   return 0;
 }
 
 /**
- * @brief Reads from board memory via DMA using driver allocated buffers
+ * @brief Waits until DMA read to target buffer is finished
+ * @note This function may block.
+ *
+ * @param mdev   Target device
+ * @param xfer   Queue entry of the transfer
+ *
+ * @retval 0            Success
+ * @retval -EIO         Timed out while waiting for end of DMA IRQ
+ */
+int pcieuni_wait_dma_read(module_dev* mdev, pcieuni_dma_xfer* xfer) {
+  return pcieuni_wait_dma(mdev, xfer);
+}
+
+/**
+ * @brief Waits until DMA write from source buffer is finished
+ * @note This function may block.
+ *
+ * @param mdev   Target device
+ * @param xfer   Queue entry of the transfer
+ *
+ * @retval 0            Success
+ * @retval -EIO         Timed out while waiting for end of DMA IRQ
+ */
+int pcieuni_wait_dma_write(module_dev* mdev, pcieuni_dma_xfer* xfer) {
+  return pcieuni_wait_dma(mdev, xfer);
+}
+
+/**
+ * @brief Reads from board memory via DMA into a free driver buffer
+ *
+ * The buffer is taken from the buffer list and synced for CPU access when the function returns. The caller owns the
+ * buffer and must hand it back with pcieuni_bufferList_set_free().
+ * @note This function may block.
  *
  * @param dev         Target device
  * @param devOffset   DMA offset to read from
+ * @param dataSize    Size of data to be read, must fit into one driver buffer
+ *
+ * @return  Buffer holding the data
+ * @retval  -EINVAL    Data does not fit into a driver buffer
+ * @retval  -ENOMEM    Failed to get target driver buffer
+ * @retval  -EBUSY     Cannot initiate DMA because target device is busy
+ * @retval  -EINTR     Operation was interupted
+ * @retval  -EIO       Failed to write to device registers or timed out while waiting for end of DMA IRQ
+ */
+pcieuni_buffer* pcieuni_dma_read_to_buffer(pcieuni_dev* dev, unsigned long devOffset, unsigned long dataSize) {
+  int retVal = 0;
+  unsigned long dmaSize = PCIEUNI_DMA_SYZE * DIV_ROUND_UP(dataSize, PCIEUNI_DMA_SYZE);
+  pcieuni_buffer* buffer;
+  pcieuni_dma_xfer xfer;
+  struct module_dev* mdev = pcieuni_get_mdev(dev);
+
+  if(!dev->memmory_base2) return ERR_PTR(-EFAULT);
+  if(!dataSize || !mdev->dmaSlotCount || dmaSize > mdev->dmaSlots[0].buffer->size) return ERR_PTR(-EINVAL);
+
+  buffer = pcieuni_bufferList_get_free(&mdev->dmaBuffers);
+  if(IS_ERR(buffer)) return buffer;
+
+  buffer->dma_size = dmaSize;
+  buffer->dma_offset = devOffset;
+  pcieuni_dma_sync_chunk(mdev, buffer, -1, true);
+  retVal = pcieuni_start_dma_read(dev, buffer, &xfer);
+  if(!retVal) retVal = pcieuni_wait_dma_read(mdev, &xfer);
+  pcieuni_dma_sync_chunk(mdev, buffer, -1, false);
+
+  if(retVal) {
+    pcieuni_bufferList_set_free(&mdev->dmaBuffers, buffer);
+    return ERR_PTR(retVal);
+  }
+
+  return buffer;
+}
+
+/**
+ * @brief Checks whether DMA read can be done directly into the user-space buffer
+ *
+ * The user buffer must be page aligned and the read size a multiple of the page size, so that every DMA segment of the
+ * pinned buffer starts and ends on a page boundary.
+ *
  * @param dataSize    Size of data to be read
  * @param userBuffer  Target user-space buffer
  *
+ * @return true if zero-copy read is possible
+ */
+static bool pcieuni_dma_read_direct_ok(unsigned long dataSize, void* userBuffer) {
+  if(!zero_copy_min_sz_kb || dataSize < zero_copy_min_sz_kb * 1024) return false;
+  if(!PAGE_ALIGNED(userBuffer) || (dataSize % PAGE_SIZE) || (dataSize % PCIEUNI_DMA_SYZE)) return false;
+  return true;
+}
+
+/**
+ * @brief Records a finished DMA transfer in the timestamps of a read
+ *
+ * @param ts    Timestamps of the read or NULL
+ * @param xfer  Finished transfer
+ */
+static void pcieuni_dma_stamp(pcieuni_dma_timestamps* ts, pcieuni_dma_xfer* xfer) {
+  if(!ts) return;
+  if(!ts->start_ns) ts->start_ns = xfer->startNs;
+  ts->irq_ns = xfer->doneNs;
+  ts->copy_ns = ktime_get_ns();
+}
+
+/**
+ * @brief Reads from board memory via DMA directly into the user-space buffer
+ *
+ * The user pages are pinned and mapped for DMA, then the DMA segments of the mapping are all queued on the DMA engine
+ * at once and transferred by the device without an intermediate copy. The segments are limited to the maximal DMA
+ * segment size of the device. If the pages cannot be mapped for DMA the data is read through the driver buffers
+ * instead. If a transfer times out, the pages stay pinned and mapped until the DMA engine is done with them, see
+ * pcieuni_dma_orphan_add(). The caller must check the buffer with pcieuni_dma_read_direct_ok() first.
+ * @note This function may block.
+ * @note module_dev::dmaReadMutex is not taken: it keeps concurrent reads from starving each other of the driver
+ * buffers, which are not used here. The transfers are serialized by the DMA engine queue like those of other reads,
+ * so a zero-copy read may interleave with them on the engine but never shares memory with them.
+ *
+ * @param dev         Target device
+ * @param devOffset   DMA offset to read from
+ * @param dataSize    Size of data to be read
+ * @param userBuffer  Target user-space buffer
+ * @param ts          Returns timestamps of the read, may be NULL
+ *
+ * @retval  0          Success
+ * @retval  -EFAULT    Failed to pin the user-space buffer
+ * @retval  -ENOMEM    Failed to allocate the page list or transfer descriptors
+ * @retval  -EBUSY     Cannot initiate DMA because target device is busy
+ * @retval  -EINTR     Operation was interupted
+ * @retval  -EIO       Failed to write to device registers
+ * @retval  -EIO       Timed out while waiting for end of DMA IRQ from device
+ */
+static int pcieuni_dma_read_direct(pcieuni_dev* dev, unsigned long devOffset, unsigned long dataSize, void* userBuffer,
+    pcieuni_dma_timestamps* ts) {
+  int retVal = 0;
+  int code;
+  unsigned long nPages = dataSize >> PAGE_SHIFT;
+  unsigned long dataReq = 0;
+  long nPinned = 0;
+  struct page** pages;
+  struct sg_table sgt;
+  struct scatterlist* sg;
+  pcieuni_buffer* chunks = 0;     // DMA descriptors of the user-buffer segments
+  pcieuni_dma_xfer* xfers = 0;    // Transfers of the segments
+  pcieuni_dma_orphan* orphan = 0; // Takes over the pages if the DMA engine may still write to them
+  unsigned int nQueued = 0;       // Number of segments queued on the DMA engine
+  unsigned int i;
+  bool engineBusy = false;        // The DMA engine may still write to the user pages
+  pcieuni_dma_segment segment = {.devOffset = devOffset, .dataSize = dataSize, .userBuffer = userBuffer};
+  struct device* dmaDev = &dev->pcieuni_pci_dev->dev;
+  struct module_dev* mdev = pcieuni_get_mdev(dev);
+
+  PDEBUG(dev->name, "pcieuni_dma_read_direct(devOffset=0x%lx, dataSize=0x%lx)\n", devOffset, dataSize);
+
+  pages = kvmalloc_array(nPages, sizeof(struct page*), GFP_KERNEL);
+  if(!pages) return -ENOMEM;
+
+  nPinned = pin_user_pages_fast((unsigned long)userBuffer, nPages, FOLL_WRITE, pages);
+  if(nPinned != nPages) {
+    retVal = nPinned < 0 ? nPinned : -EFAULT;
+    goto cleanup_unpin;
+  }
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 15, 0)
+  retVal = sg_alloc_table_from_pages_segment(
+      &sgt, pages, nPages, 0, dataSize, dma_get_max_seg_size(dmaDev), GFP_KERNEL);
+#else
+  retVal = sg_alloc_table_from_pages(&sgt, pages, nPages, 0, dataSize, GFP_KERNEL);
+#endif
+  if(retVal) goto cleanup_unpin;
+
+  if(dma_map_sgtable(dmaDev, &sgt, DMA_FROM_DEVICE, 0)) {
+    // no IOMMU mapping or bounce buffer available for the user pages - the driver buffers are always mapped
+    sg_free_table(&sgt);
+    unpin_user_pages(pages, nPinned);
+    kvfree(pages);
+    return pcieuni_dma_read_segments(dev, &segment, 1, ts);
+  }
+
+  chunks = kcalloc(sgt.nents, sizeof(pcieuni_buffer), GFP_KERNEL);
+  xfers = kcalloc(sgt.nents, sizeof(pcieuni_dma_xfer), GFP_KERNEL);
+  orphan = kzalloc(sizeof(pcieuni_dma_orphan), GFP_KERNEL);
+  if(!chunks || !xfers || !orphan) {
+    retVal = -ENOMEM;
+    goto cleanup_unmap;
+  }
+
+  // IOMMU may merge the pages into fewer, larger segments; each segment is one DMA transfer, all queued at once
+  for_each_sgtable_dma_sg(&sgt, sg, i) {
+    chunks[i].dma_handle = sg_dma_address(sg);
+    chunks[i].dma_size = sg_dma_len(sg);
+    chunks[i].dma_offset = devOffset + dataReq;
+    set_bit(BUFFER_STATE_WAITING, &chunks[i].state);
+
+    retVal = pcieuni_start_dma_read(dev, &chunks[i], &xfers[i]);
+    if(retVal) break;
+
+    dataReq += chunks[i].dma_size;
+    nQueued++;
+  }
+
+  // the engine works through the queue in order
+  for(i = 0; i < nQueued; i++) {
+    if(engineBusy) {
+      // a transfer timed out - drop the rest, one of them may have been started already
+      pcieuni_dma_cancel(mdev, &chunks[i]);
+      continue;
+    }
+
+    code = pcieuni_wait_dma_read(mdev, &xfers[i]);
+    if(code) {
+      retVal = code;
+      engineBusy = true;
+      continue;
+    }
+    pcieuni_dma_stamp(ts, &xfers[i]);
+  }
+
+  if(engineBusy) {
+    // the engine was not stopped and may still write to the user pages, they stay pinned and mapped until it is done
+    orphan->sgt = sgt;
+    orphan->pages = pages;
+    orphan->nPages = nPages;
+    pcieuni_dma_orphan_add(mdev, orphan);
+    pages = 0;
+    orphan = 0;
+    goto cleanup_alloc;
+  }
+
+cleanup_unmap:
+  dma_unmap_sgtable(dmaDev, &sgt, DMA_FROM_DEVICE, 0);
+  sg_free_table(&sgt);
+
+cleanup_unpin:
+  if(nPinned > 0) unpin_user_pages_dirty_lock(pages, nPinned, nQueued > 0);
+
+cleanup_alloc:
+  kfree(orphan);
+  kfree(xfers);
+  kfree(chunks);
+  kvfree(pages);
+
+  PDEBUG(dev->name, "pcieuni_dma_read_direct(devOffset=0x%lx, dataSize=0x%lx): Return code(%i)\n", devOffset,
+      dataSize, retVal);
+
+  return retVal;
+}
+
+/**
+ * @brief Returns the first segment with data at or after an index
+ *
+ * @param segments   Segments of the read
+ * @param nSegments  Number of segments
+ * @param index      First index to look at
+ *
+ * @return Index of the segment or nSegments if there is none
+ */
+static int pcieuni_dma_next_segment(pcieuni_dma_segment* segments, int nSegments, int index) {
+  while(index < nSegments && !segments[index].dataSize) index++;
+  return index;
+}
+
+/**
+ * @brief Reads a list of board memory regions via DMA using driver allocated buffers
+ *
+ * All segments are pipelined through the buffers as one stream of DMA transfers, so the DMA engine does not wait
+ * between segments. Each segment is read from a page boundary in chunks of at most one buffer, each chunk goes into
+ * the best fitting buffer size class (see pcieuni_dma_get_chunk_buffer()). A segment is copied to user space or, if
+ * it has a pcieuni_dma_segment::kernelBuffer, into that kernel buffer.
+ * @note This function may block.
+ *
+ * @param dev        Target device
+ * @param segments   Segments to read
+ * @param nSegments  Number of segments
+ * @param ts         Returns timestamps of the read, may be NULL
+ *
  * @retval  0          Success
  * @retval  -EFAULT    Failed to copy data to userspace
  * @retval  -ENOMEM    Failed to get target driver buffer
@@ -140,90 +607,408 @@ int pcieuni_wait_dma_read(module_dev* mdev, pcieuni_buffer* buffer) {
  * @retval  -EIO       Failed to write to device registers
  * @retval  -EIO       Timed out while waiting for end of DMA IRQ from device
  */
-int pcieuni_dma_read(pcieuni_dev* dev, unsigned long devOffset, unsigned long dataSize, void* userBuffer) {
+int pcieuni_dma_read_segments(
+    pcieuni_dev* dev, pcieuni_dma_segment* segments, int nSegments, pcieuni_dma_timestamps* ts) {
   int retVal = 0;
-  unsigned long dmaSize =
-      PCIEUNI_DMA_SYZE * DIV_ROUND_UP(dataSize, PCIEUNI_DMA_SYZE); // round up total read-size to page boundary
-  unsigned long dataReq = 0;                                       // Total size of data that was requested from device
-  unsigned long dataRead = 0;                                      // Total size of data read from device
-  pcieuni_buffer* prevBuffer = 0;                                  // buffer used for read in previous loop
-  pcieuni_buffer* nextBuffer = 0;                                  // buffer to read to in this loop
+  int reqSegment = pcieuni_dma_next_segment(segments, nSegments, 0); // Segment of the next chunk to request
+  int readSegment = reqSegment;                                      // Segment of the oldest chunk in flight
+  unsigned long segmentDmaSize;                                      // Size of reqSegment rounded up to page size
+  unsigned long dataReq = 0;                                         // Data of reqSegment requested from device
+  unsigned long dataRead = 0;                                        // Data of readSegment read from device
+  pcieuni_dma_xfer* xfers;                                           // FIFO of chunks in flight
+  int* classes;                                                      // Buffer size classes of the chunks in flight
+  int depth;                                                         // FIFO capacity
+  int first = 0;                                                     // FIFO index of the oldest chunk in flight
+  int nQueued = 0;                                                   // Number of chunks in flight
+  int index;
+  pcieuni_dma_xfer* xfer;
+  pcieuni_buffer* buffer;
+  pcieuni_dma_segment* segment;
+  u64 copyStart;
   struct module_dev* mdev = pcieuni_get_mdev(dev);
 
-  PDEBUG(dev->name, "pcieuni_dma_read(devOffset=0x%lx, dataSize=0x%lx)\n", devOffset, dataSize);
+  PDEBUG(dev->name, "pcieuni_dma_read_segments(nSegments=%d)\n", nSegments);
 
   if(!dev->memmory_base2) {
-    PDEBUG(dev->name, "pcieuni_dma_read: ERROR: DMA BAR not mapped!\n");
+    PDEBUG(dev->name, "pcieuni_dma_read_segments: ERROR: DMA BAR not mapped!\n");
     return -EFAULT;
   }
 
+  depth = max(mdev->dmaSlotCount + mdev->dmaClassBuffers, 1);
+  xfers = kcalloc(depth, sizeof(pcieuni_dma_xfer), GFP_KERNEL);
+  classes = kcalloc(depth, sizeof(int), GFP_KERNEL);
+  if(!xfers || !classes) {
+    retVal = -ENOMEM;
+    goto cleanup_alloc;
+  }
+
+  // concurrent reads would starve each other of buffers, register access is not affected
+  if(mutex_lock_interruptible(&mdev->dmaReadMutex)) {
+    retVal = -ERESTARTSYS;
+    goto cleanup_alloc;
+  }
+
   // Loop until data is read
-  for(; !IS_ERR(prevBuffer) && (dataRead < dmaSize);) {
-    if(retVal) {
-      nextBuffer = ERR_PTR(retVal);
-    }
-    else {
-      // if there is more data to be requested from device
-      if(dataReq < dmaSize) {
-        // Find and reserve target buffer
-        nextBuffer = pcieuni_bufferList_get_free(&mdev->dmaBuffers);
-        if(!IS_ERR(nextBuffer)) {
-          // prepare buffer to accept DMA data from device
-          dma_sync_single_for_device(
-              &dev->pcieuni_pci_dev->dev, nextBuffer->dma_handle, (size_t)nextBuffer->size, DMA_FROM_DEVICE);
-
-          // request read of next data chunk
-          nextBuffer->dma_size = min(dmaSize - dataReq, nextBuffer->size);
-          nextBuffer->dma_offset = devOffset + dataReq;
-          retVal = pcieuni_start_dma_read(dev, nextBuffer);
-          if(retVal) {
-            // make buffer available for next DMA request
-            dma_sync_single_for_cpu(
-                &dev->pcieuni_pci_dev->dev, nextBuffer->dma_handle, (size_t)nextBuffer->size, DMA_FROM_DEVICE);
-            pcieuni_bufferList_set_free(&mdev->dmaBuffers, nextBuffer);
-            nextBuffer = ERR_PTR(retVal);
-          }
-        }
+  for(;;) {
+    // keep as many chunks in flight as there are free buffers, so the device does not wait for the copy to user space
+    while(!retVal && (reqSegment < nSegments) && (nQueued < depth)) {
+      segmentDmaSize = PCIEUNI_DMA_SYZE * DIV_ROUND_UP(segments[reqSegment].dataSize, PCIEUNI_DMA_SYZE);
+      index = (first + nQueued) % depth;
 
-        if(!IS_ERR(nextBuffer)) {
-          dataReq += nextBuffer->dma_size; // add to total data requested
-        }
+      // Find and reserve target buffer
+      buffer = pcieuni_dma_get_chunk_buffer(mdev, segmentDmaSize - dataReq, &classes[index]);
+      if(!buffer) {
+        // other chunks are in flight - wait for the oldest one to finish
+        if(!nQueued) retVal = -EBUSY;
+        break;
+      }
+      if(IS_ERR(buffer)) {
+        retVal = PTR_ERR(buffer);
+        break;
       }
-      else {
-        nextBuffer = 0;
+
+      // request read of next data chunk, only the bytes the device writes are synced
+      buffer->dma_size = min(segmentDmaSize - dataReq, buffer->size);
+      buffer->dma_offset = segments[reqSegment].devOffset + dataReq;
+      pcieuni_dma_sync_chunk(mdev, buffer, classes[index], true);
+      xfer = &xfers[index];
+      retVal = pcieuni_start_dma_read(dev, buffer, xfer);
+      if(retVal) {
+        // make buffer available for next DMA request
+        pcieuni_dma_sync_chunk(mdev, buffer, classes[index], false);
+        pcieuni_dma_put_chunk_buffer(mdev, buffer, classes[index]);
+        break;
+      }
+
+      dataReq += buffer->dma_size; // add to total data requested
+      if(dataReq >= segmentDmaSize) {
+        reqSegment = pcieuni_dma_next_segment(segments, nSegments, reqSegment + 1);
+        dataReq = 0;
       }
+      nQueued++;
     }
 
-    // if data read was requested for prevBuffer
-    if(prevBuffer) {
-      // wait until data read is completed (device irq)
-      retVal = pcieuni_wait_dma_read(mdev, prevBuffer);
+    if(!nQueued) break;
+
+    // wait until the oldest chunk is read (device irq) and copy it to the proper offset in the target buffer
+    xfer = &xfers[first];
+    buffer = xfer->buffer;
+    if(!retVal) {
+      retVal = pcieuni_wait_dma_read(mdev, xfer);
+    }
+    else if(retVal == -EFAULT) {
+      // the device is fine - let it finish writing into the buffer before the buffer is reused
+      pcieuni_wait_dma_read(mdev, xfer);
+    }
+    else {
+      // the device failed - drop the chunks still in flight
+      pcieuni_dma_cancel(mdev, buffer);
+    }
+
+    pcieuni_dma_sync_chunk(mdev, buffer, classes[first], false);
+    if(!retVal) {
+      segment = &segments[readSegment];
+      copyStart = ktime_get_ns();
+      if(segment->kernelBuffer) {
+        memcpy(segment->kernelBuffer + dataRead, (void*)buffer->kaddr,
+            min(buffer->dma_size, segment->dataSize - dataRead));
+      }
+      else if(copy_to_user(segment->userBuffer + dataRead, (void*)buffer->kaddr,
+                  min(buffer->dma_size, segment->dataSize - dataRead))) {
+        retVal = -EFAULT;
+      }
       if(!retVal) {
-        // copy data to proper offset in the target user-space buffer
-        dma_sync_single_for_cpu(
-            &dev->pcieuni_pci_dev->dev, prevBuffer->dma_handle, (size_t)prevBuffer->size, DMA_FROM_DEVICE);
-        if(copy_to_user(
-               userBuffer + dataRead, (void*)prevBuffer->kaddr, min(prevBuffer->dma_size, dataSize - dataRead))) {
-          retVal = -EFAULT;
-        }
-        else {
-          // add to total data read
-          dataRead += prevBuffer->dma_size;
+        trace_pcieuni_dma_copy(mdev->brd_num, buffer, buffer->dma_offset, buffer->dma_size);
+        pcieuni_dma_stamp(ts, xfer);
+        // add to total data read, the last chunk of a segment may be longer than the rest of the segment
+        dataRead += buffer->dma_size;
+        if(dataRead >= segment->dataSize) {
+          readSegment = pcieuni_dma_next_segment(segments, nSegments, readSegment + 1);
+          dataRead = 0;
         }
       }
-      // mark buffer available
-      pcieuni_bufferList_set_free(&mdev->dmaBuffers, prevBuffer);
+      atomic64_inc(&mdev->stats.copies);
+      atomic64_add(ktime_get_ns() - copyStart, &mdev->stats.copyNs);
+    }
+
+    // mark buffer available
+    pcieuni_dma_put_chunk_buffer(mdev, buffer, classes[first]);
+    first = (first + 1) % depth;
+    nQueued--;
+  }
+
+  mutex_unlock(&mdev->dmaReadMutex);
+
+cleanup_alloc:
+  kfree(classes);
+  kfree(xfers);
+
+  PDEBUG(dev->name, "pcieuni_dma_read_segments(nSegments=%d): Return code(%i)\n", nSegments, retVal);
+
+  return retVal;
+}
+
+/**
+ * @brief Reads from board memory via DMA using driver allocated buffers and returns the timestamps of the read
+ *
+ * Large reads into a page aligned user buffer are transferred directly into the user pages instead
+ * (see pcieuni_dma_read_direct()).
+ *
+ * @param dev         Target device
+ * @param devOffset   DMA offset to read from
+ * @param dataSize    Size of data to be read
+ * @param userBuffer  Target user-space buffer
+ * @param ts          Returns timestamps of the read, may be NULL
+ *
+ * @retval  0          Success
+ * @retval  -EFAULT    Failed to copy data to userspace
+ * @retval  -ENOMEM    Failed to get target driver buffer
+ * @retval  -EBUSY     Cannot initiate DMA because target device is busy
+ * @retval  -EINTR     Operation was interupted
+ * @retval  -EIO       Failed to write to device registers
+ * @retval  -EIO       Timed out while waiting for end of DMA IRQ from device
+ */
+int pcieuni_dma_read_ts(pcieuni_dev* dev, unsigned long devOffset, unsigned long dataSize, void* userBuffer,
+    pcieuni_dma_timestamps* ts) {
+  pcieuni_dma_segment segment = {.devOffset = devOffset, .dataSize = dataSize, .userBuffer = userBuffer};
+
+  PDEBUG(dev->name, "pcieuni_dma_read(devOffset=0x%lx, dataSize=0x%lx)\n", devOffset, dataSize);
+
+  if(ts) {
+    memset(ts, 0, sizeof(pcieuni_dma_timestamps));
+    ts->submit_ns = ktime_get_ns();
+  }
+
+  if(!dev->memmory_base2) {
+    PDEBUG(dev->name, "pcieuni_dma_read: ERROR: DMA BAR not mapped!\n");
+    return -EFAULT;
+  }
+
+  if(pcieuni_dma_read_direct_ok(dataSize, userBuffer)) {
+    return pcieuni_dma_read_direct(dev, devOffset, dataSize, userBuffer, ts);
+  }
+
+  return pcieuni_dma_read_segments(dev, &segment, 1, ts);
+}
+
+/**
+ * @brief Reads from board memory via DMA using driver allocated buffers
+ *
+ * See pcieuni_dma_read_ts().
+ *
+ * @param dev         Target device
+ * @param devOffset   DMA offset to read from
+ * @param dataSize    Size of data to be read
+ * @param userBuffer  Target user-space buffer
+ *
+ * @return Result of pcieuni_dma_read_ts()
+ */
+int pcieuni_dma_read(pcieuni_dev* dev, unsigned long devOffset, unsigned long dataSize, void* userBuffer) {
+  return pcieuni_dma_read_ts(dev, devOffset, dataSize, userBuffer, 0);
+}
+
+/**
+ * @brief Reads a scatter/gather list of board memory regions via DMA
+ *
+ * @param dev          Target device
+ * @param userEntries  User-space vector of regions to read
+ * @param count        Number of regions
+ *
+ * @retval  0          Success
+ * @retval  -EINVAL    Too many regions
+ * @retval  -EFAULT    Failed to copy the regions from user space or data to user space
+ * @retval  -ENOMEM    Failed to allocate memory for the regions or to get target driver buffer
+ * @retval  <0         Error code of pcieuni_dma_read_segments()
+ */
+int pcieuni_dma_read_sg(pcieuni_dev* dev, const pcieuni_dma_sg_entry __user* userEntries, u32 count) {
+  int retVal = 0;
+  u32 i;
+  pcieuni_dma_sg_entry entry;
+  pcieuni_dma_segment* segments;
+
+  PDEBUG(dev->name, "pcieuni_dma_read_sg(count=%u)\n", count);
+
+  if(!count) return 0;
+  if(count > PCIEUNI_DMA_SG_MAX) return -EINVAL;
+
+  segments = kvmalloc_array(count, sizeof(pcieuni_dma_segment), GFP_KERNEL);
+  if(!segments) return -ENOMEM;
+
+  for(i = 0; i < count; i++) {
+    if(copy_from_user(&entry, &userEntries[i], sizeof(pcieuni_dma_sg_entry))) {
+      retVal = -EFAULT;
+      goto cleanup;
+    }
+    segments[i].devOffset = entry.dma_offset;
+    segments[i].dataSize = entry.dma_size;
+    segments[i].userBuffer = (void __user*)(uintptr_t)entry.data;
+    segments[i].kernelBuffer = 0;
+  }
+
+  retVal = pcieuni_dma_read_segments(dev, segments, count, 0);
+
+cleanup:
+  kvfree(segments);
+  return retVal;
+}
+
+/**
+ * @brief Allocates the source buffers of a DMA write and maps them for device reading
+ *
+ * Each DMA write has buffers of its own, so it neither shares the driver buffers mapped for device writing nor waits
+ * for the DMA reads using them. The buffers are at most as large as the driver buffers. Fragmented memory may only
+ * have smaller contiguous blocks left, so the size is halved on failure, staying a multiple of PCIEUNI_DMA_ALLOC_ALIGN.
+ *
+ * @param dev      Target device
+ * @param dmaSize  Size of the write
+ * @param buffers  Returns PCIEUNI_DMA_WRITE_BUFFERS buffers, kaddr, dma_handle and size are set
+ *
+ * @retval 0        Success
+ * @retval -ENOMEM  Failed to allocate or map the buffers
+ */
+static int pcieuni_dma_write_buffers_alloc(pcieuni_dev* dev, unsigned long dmaSize, pcieuni_buffer* buffers) {
+  struct device* dmaDev = &dev->pcieuni_pci_dev->dev;
+  struct module_dev* mdev = pcieuni_get_mdev(dev);
+  unsigned long size = max(rounddown(READ_ONCE(mdev->dmaBufferSize), PCIEUNI_DMA_ALLOC_ALIGN), PCIEUNI_DMA_ALLOC_ALIGN);
+  int i;
+
+  size = min(size, roundup(dmaSize, PCIEUNI_DMA_ALLOC_ALIGN));
+  for(;;) {
+    for(i = 0; i < PCIEUNI_DMA_WRITE_BUFFERS; i++) {
+      memset(&buffers[i], 0, sizeof(pcieuni_buffer));
+      buffers[i].kaddr = (unsigned long)kmalloc(size, GFP_KERNEL | __GFP_NOWARN);
+      if(!buffers[i].kaddr) break;
+
+      buffers[i].size = size;
+      buffers[i].dma_handle = dma_map_single(dmaDev, (void*)buffers[i].kaddr, size, DMA_TO_DEVICE);
+      if(dma_mapping_error(dmaDev, buffers[i].dma_handle)) {
+        kfree((void*)buffers[i].kaddr);
+        break;
+      }
+    }
+    if(i == PCIEUNI_DMA_WRITE_BUFFERS) return 0;
+
+    while(i--) {
+      dma_unmap_single(dmaDev, buffers[i].dma_handle, size, DMA_TO_DEVICE);
+      kfree((void*)buffers[i].kaddr);
     }
+    if(size <= PCIEUNI_DMA_ALLOC_ALIGN) return -ENOMEM;
+    size = max(rounddown(size / 2, PCIEUNI_DMA_ALLOC_ALIGN), PCIEUNI_DMA_ALLOC_ALIGN);
+  }
+}
+
+/**
+ * @brief Frees the buffers allocated by pcieuni_dma_write_buffers_alloc()
+ *
+ * @param dev      Target device
+ * @param buffers  Source buffers of the write
+ */
+static void pcieuni_dma_write_buffers_free(pcieuni_dev* dev, pcieuni_buffer* buffers) {
+  struct device* dmaDev = &dev->pcieuni_pci_dev->dev;
+  int i;
+
+  for(i = 0; i < PCIEUNI_DMA_WRITE_BUFFERS; i++) {
+    dma_unmap_single(dmaDev, buffers[i].dma_handle, buffers[i].size, DMA_TO_DEVICE);
+    kfree((void*)buffers[i].kaddr);
+  }
+}
+
+/**
+ * @brief Writes from user space to board memory via DMA
+ *
+ * The data is split into pieces that fit into the source buffers of the write (see
+ * pcieuni_dma_write_buffers_alloc()). While the device reads one piece the next one is copied from user space into
+ * the other buffer. The last piece is padded with zeros to the DMA granularity. Neither the driver buffers nor
+ * module_dev::dmaReadMutex are used, so a page fault while copying the user data does not hold up DMA reads; the
+ * transfers are serialized with those of the reads by the DMA engine queue.
+ * @note This function may block.
+ *
+ * @param dev         Target device
+ * @param devOffset   DMA offset to write to
+ * @param dataSize    Size of data to be written
+ * @param userBuffer  Source user-space buffer
+ *
+ * @retval  0             Success
+ * @retval  -EOPNOTSUPP   Firmware has no host to device DMA channel (see ::dma_write)
+ * @retval  -EFAULT       Failed to copy data from userspace
+ * @retval  -ENOMEM       Failed to allocate or map source buffers
+ * @retval  -EBUSY        Cannot initiate DMA because target device is busy
+ * @retval  -EIO          Failed to write to device registers
+ * @retval  -EIO          Timed out while waiting for end of DMA IRQ from device
+ */
+int pcieuni_dma_write(
+    pcieuni_dev* dev, unsigned long devOffset, unsigned long dataSize, const void __user* userBuffer) {
+  int retVal = 0;
+  unsigned long dmaSize = PCIEUNI_DMA_SYZE * DIV_ROUND_UP(dataSize, PCIEUNI_DMA_SYZE);
+  unsigned long dataReq = 0;                         // Total size of data that was handed to the device
+  unsigned long copySize;                            // Size of user data in the current piece
+  pcieuni_buffer buffers[PCIEUNI_DMA_WRITE_BUFFERS]; // Source buffers, FIFO of pieces in flight
+  pcieuni_dma_xfer xfers[PCIEUNI_DMA_WRITE_BUFFERS]; // Transfers of the pieces in flight
+  int first = 0;                                     // FIFO index of the oldest piece in flight
+  int nQueued = 0;                                   // Number of pieces in flight
+  pcieuni_buffer* buffer;
+  struct device* dmaDev = &dev->pcieuni_pci_dev->dev;
+  struct module_dev* mdev = pcieuni_get_mdev(dev);
+
+  PDEBUG(dev->name, "pcieuni_dma_write(devOffset=0x%lx, dataSize=0x%lx)\n", devOffset, dataSize);
+
+  if(!dma_write) return -EOPNOTSUPP;
 
-    prevBuffer = nextBuffer;
+  if(!dev->memmory_base2) {
+    PDEBUG(dev->name, "pcieuni_dma_write: ERROR: DMA BAR not mapped!\n");
+    return -EFAULT;
   }
 
-  if(IS_ERR(prevBuffer)) {
-    retVal = retVal ? retVal : PTR_ERR(prevBuffer);
+  retVal = pcieuni_dma_write_buffers_alloc(dev, dmaSize, buffers);
+  if(retVal) return retVal;
+
+  // Loop until data is written
+  for(;;) {
+    while(!retVal && (dataReq < dmaSize) && (nQueued < PCIEUNI_DMA_WRITE_BUFFERS)) {
+      // fill the buffer with the next piece of user data
+      buffer = &buffers[(first + nQueued) % PCIEUNI_DMA_WRITE_BUFFERS];
+      buffer->dma_size = min(dmaSize - dataReq, buffer->size);
+      buffer->dma_offset = devOffset + dataReq;
+      copySize = min(buffer->dma_size, dataSize - dataReq);
+      if(copy_from_user((void*)buffer->kaddr, userBuffer + dataReq, copySize)) {
+        retVal = -EFAULT;
+        break;
+      }
+      memset((void*)(buffer->kaddr + copySize), 0, buffer->dma_size - copySize);
+
+      // the CPU has written the buffer - hand it over to the device
+      dma_sync_single_for_device(dmaDev, buffer->dma_handle, buffer->dma_size, DMA_TO_DEVICE);
+      set_bit(BUFFER_STATE_WAITING, &buffer->state);
+      retVal = pcieuni_start_dma_write(dev, buffer, &xfers[(first + nQueued) % PCIEUNI_DMA_WRITE_BUFFERS]);
+      if(retVal) break;
+
+      dataReq += buffer->dma_size;
+      nQueued++;
+    }
+
+    if(!nQueued) break;
+
+    // wait until the oldest piece is read by the device, only then its buffer may be written again
+    if(!retVal) {
+      retVal = pcieuni_wait_dma_write(mdev, &xfers[first]);
+    }
+    else if(retVal == -EFAULT) {
+      // the device is fine - let it finish reading the buffer before the buffer is freed
+      pcieuni_wait_dma_write(mdev, &xfers[first]);
+    }
+    else {
+      // the device failed - drop the pieces still in flight
+      pcieuni_dma_cancel(mdev, &buffers[first]);
+    }
+
+    first = (first + 1) % PCIEUNI_DMA_WRITE_BUFFERS;
+    nQueued--;
   }
 
+  pcieuni_dma_write_buffers_free(dev, buffers);
+
   PDEBUG(
-      dev->name, "pcieuni_dma_read(devOffset=0x%lx, dataSize=0x%lx): Return code(%i)\n", devOffset, dataSize, retVal);
+      dev->name, "pcieuni_dma_write(devOffset=0x%lx, dataSize=0x%lx): Return code(%i)\n", devOffset, dataSize, retVal);
 
   return retVal;
 }
@@ -252,6 +1037,20 @@ long pcieuni_ioctl_dma(struct file* filp, unsigned int* cmd_p, unsigned long* ar
   int io_dma_size;
   device_ioctrl_time time_data;
   device_ioctrl_dma dma_data;
+  pcieuni_ring_info ring_info;
+  pcieuni_ring_dma ring_dma;
+  u32 ring_slot;
+  pcieuni_dma_async async_data;
+  pcieuni_dma_result async_result;
+  pcieuni_write_dma write_data;
+  pcieuni_reg_batch reg_batch;
+  pcieuni_dma_sg sg_data;
+  pcieuni_read_dma_ts read_ts;
+  pcieuni_event_subscribe event_sub;
+  pcieuni_event event;
+  pcieuni_stream_config stream_config;
+  pcieuni_stream_slot stream_slot;
+  pcieuni_read_dma_trigger read_trigger;
 
   module_dev* module_dev_pp;
   pcieuni_dev* dev = filp->private_data;
@@ -266,7 +1065,7 @@ long pcieuni_ioctl_dma(struct file* filp, unsigned int* cmd_p, unsigned long* ar
   cur_proc = current->group_leader->pid;
   pdev = (dev->pcieuni_pci_dev);
 
-  if(!dev->dev_sts) {
+  if(!dev->dev_sts || !module_dev_pp) {
     printk(KERN_DEBUG "pcieuni: no device %d\n", dev->dev_num);
     retval = -EFAULT;
     return retval;
@@ -283,23 +1082,23 @@ long pcieuni_ioctl_dma(struct file* filp, unsigned int* cmd_p, unsigned long* ar
   err = !access_ok((void __user*)arg, _IOC_SIZE(cmd));
   if(err) return -EFAULT;
 
-  if(mutex_lock_interruptible(&dev->dev_mut)) return -ERESTARTSYS;
-
+  /*
+   * dev->dev_mut is not held here: it serializes register access of the universal driver, which must not wait for DMA.
+   * The DMA engine registers are serialized by module_dev::dmaLock, the driver state by the locks of module_dev.
+   */
   switch(cmd) {
     case PCIEUNI_GET_DMA_TIME:
       retval = 0;
+      if(mutex_lock_interruptible(&dev->dev_mut)) return -ERESTARTSYS;
 
-      module_dev_pp->dma_start_time.tv_sec += (long)dev->slot_num;
-      module_dev_pp->dma_stop_time.tv_sec += (long)dev->slot_num;
-      module_dev_pp->dma_start_time.tv_nsec += (long)dev->brd_num * NSEC_PER_USEC;
-      module_dev_pp->dma_stop_time.tv_nsec += (long)dev->brd_num * NSEC_PER_USEC;
-      time_data.start_time.tv_sec = module_dev_pp->dma_start_time.tv_sec;
-      time_data.stop_time.tv_sec = module_dev_pp->dma_stop_time.tv_sec;
-      time_data.start_time.tv_usec = module_dev_pp->dma_start_time.tv_nsec / NSEC_PER_USEC;
-      time_data.stop_time.tv_usec = module_dev_pp->dma_stop_time.tv_nsec / NSEC_PER_USEC;
+      // the slot and board offsets are applied to the reported times only, the stored times must not drift
+      time_data.start_time.tv_sec = module_dev_pp->dma_start_time.tv_sec + (long)dev->slot_num;
+      time_data.stop_time.tv_sec = module_dev_pp->dma_stop_time.tv_sec + (long)dev->slot_num;
+      time_data.start_time.tv_usec = module_dev_pp->dma_start_time.tv_nsec / NSEC_PER_USEC + dev->brd_num;
+      time_data.stop_time.tv_usec = module_dev_pp->dma_stop_time.tv_nsec / NSEC_PER_USEC + dev->brd_num;
+      mutex_unlock(&dev->dev_mut);
       if(copy_to_user((device_ioctrl_time*)arg, &time_data, (size_t)size_time)) {
         retval = -EIO;
-        mutex_unlock(&dev->dev_mut);
         return retval;
       }
       break;
@@ -307,18 +1106,203 @@ long pcieuni_ioctl_dma(struct file* filp, unsigned int* cmd_p, unsigned long* ar
     case PCIEUNI_READ_DMA: {
       // Copy DMA transfer arguments into workqeue-data structure
       if(copy_from_user(&dma_data, (void*)arg, io_dma_size)) {
-        mutex_unlock(&dev->dev_mut);
         return -EFAULT;
       }
 
-      retval = pcieuni_dma_read(dev, dma_data.dma_offset, dma_data.dma_size, (void*)arg);
+      retval = pcieuni_dma_read_merged(dev, dma_data.dma_offset, dma_data.dma_size, (void*)arg);
       break;
     }
 
+    case PCIEUNI_READ_DMA_TS:
+      if(copy_from_user(&read_ts, (void*)arg, sizeof(pcieuni_read_dma_ts))) {
+        retval = -EFAULT;
+        break;
+      }
+
+      retval = pcieuni_dma_read_ts(
+          dev, read_ts.dma_offset, read_ts.dma_size, (void __user*)(uintptr_t)read_ts.data, &read_ts.ts);
+      if(!retval && copy_to_user((void*)arg, &read_ts, sizeof(pcieuni_read_dma_ts))) {
+        retval = -EFAULT;
+      }
+      break;
+
+    case PCIEUNI_READ_DMA_TRIGGERED:
+      if(copy_from_user(&read_trigger, (void*)arg, sizeof(pcieuni_read_dma_trigger))) {
+        retval = -EFAULT;
+        break;
+      }
+      if(read_trigger.reserved) {
+        retval = -EINVAL;
+        break;
+      }
+
+      retval = pcieuni_dma_read_triggered(dev, read_trigger.dma_offset, read_trigger.dma_size,
+          (void __user*)(uintptr_t)read_trigger.data, read_trigger.timeout_ms, &read_trigger.trigger_ns,
+          &read_trigger.irq_ns);
+      if(!retval && copy_to_user((void*)arg, &read_trigger, sizeof(pcieuni_read_dma_trigger))) {
+        retval = -EFAULT;
+      }
+      break;
+
+    case PCIEUNI_READ_DMA_SG:
+      if(copy_from_user(&sg_data, (void*)arg, sizeof(pcieuni_dma_sg))) {
+        retval = -EFAULT;
+        break;
+      }
+      if(sg_data.reserved) {
+        retval = -EINVAL;
+        break;
+      }
+
+      retval = pcieuni_dma_read_sg(dev, (const pcieuni_dma_sg_entry __user*)(uintptr_t)sg_data.entries, sg_data.count);
+      break;
+
+    case PCIEUNI_DMA_WRITE:
+      if(copy_from_user(&write_data, (void*)arg, sizeof(pcieuni_write_dma))) {
+        retval = -EFAULT;
+        break;
+      }
+
+      retval = pcieuni_dma_write(
+          dev, write_data.dma_offset, write_data.dma_size, (const void __user*)(uintptr_t)write_data.data);
+      break;
+
+    case PCIEUNI_REG_BATCH:
+      if(copy_from_user(&reg_batch, (void*)arg, sizeof(pcieuni_reg_batch))) {
+        retval = -EFAULT;
+        break;
+      }
+      if(reg_batch.reserved) {
+        retval = -EINVAL;
+        break;
+      }
+
+      retval = pcieuni_reg_run_batch(dev, (pcieuni_reg_op __user*)(uintptr_t)reg_batch.ops, reg_batch.count);
+      break;
+
+    case PCIEUNI_RING_INFO:
+      ring_info.slot_count = module_dev_pp->dmaSlotCount;
+      ring_info.slot_size = module_dev_pp->dmaSlotSize;
+      if(copy_to_user((void*)arg, &ring_info, sizeof(pcieuni_ring_info))) {
+        retval = -EFAULT;
+      }
+      break;
+
+    case PCIEUNI_RING_READ_DMA:
+      if(copy_from_user(&ring_dma, (void*)arg, sizeof(pcieuni_ring_dma))) {
+        retval = -EFAULT;
+        break;
+      }
+      if(ring_dma.reserved) {
+        retval = -EINVAL;
+        break;
+      }
+
+      retval = pcieuni_dma_ring_read(
+          dev, filp, ring_dma.dma_offset, ring_dma.dma_size, &ring_dma.slot, &ring_dma.slot_offset);
+      if(!retval && copy_to_user((void*)arg, &ring_dma, sizeof(pcieuni_ring_dma))) {
+        pcieuni_dma_ring_release(module_dev_pp, filp, ring_dma.slot);
+        retval = -EFAULT;
+      }
+      break;
+
+    case PCIEUNI_RING_RELEASE:
+      if(get_user(ring_slot, (u32*)arg)) {
+        retval = -EFAULT;
+        break;
+      }
+      retval = pcieuni_dma_ring_release(module_dev_pp, filp, ring_slot);
+      break;
+
+    case PCIEUNI_DMA_SUBMIT:
+      if(copy_from_user(&async_data, (void*)arg, sizeof(pcieuni_dma_async))) {
+        retval = -EFAULT;
+        break;
+      }
+      if(async_data.reserved) {
+        retval = -EINVAL;
+        break;
+      }
+
+      retval = pcieuni_dma_async_submit(
+          module_dev_pp, filp, async_data.dma_offset, async_data.dma_size, &async_data.id);
+      if(!retval && copy_to_user((void*)arg, &async_data, sizeof(pcieuni_dma_async))) {
+        retval = -EFAULT;
+      }
+      break;
+
+    case PCIEUNI_DMA_COLLECT:
+      if(copy_from_user(&async_result, (void*)arg, sizeof(pcieuni_dma_result))) {
+        retval = -EFAULT;
+        break;
+      }
+      if(async_result.reserved) {
+        retval = -EINVAL;
+        break;
+      }
+
+      retval = pcieuni_dma_async_collect(module_dev_pp, filp, &async_result);
+      if(!retval && copy_to_user((void*)arg, &async_result, sizeof(pcieuni_dma_result))) {
+        retval = -EFAULT;
+      }
+      break;
+
+    case PCIEUNI_EVENT_SUBSCRIBE:
+      if(copy_from_user(&event_sub, (void*)arg, sizeof(pcieuni_event_subscribe))) {
+        retval = -EFAULT;
+        break;
+      }
+      if(event_sub.reserved) {
+        retval = -EINVAL;
+        break;
+      }
+
+      retval = pcieuni_events_subscribe(module_dev_pp, filp, event_sub.eventfd);
+      break;
+
+    case PCIEUNI_EVENT_UNSUBSCRIBE:
+      pcieuni_events_release_file(module_dev_pp, filp);
+      break;
+
+    case PCIEUNI_EVENT_READ:
+      retval = pcieuni_events_read(module_dev_pp, filp, &event);
+      if(!retval && copy_to_user((void*)arg, &event, sizeof(pcieuni_event))) {
+        retval = -EFAULT;
+      }
+      break;
+
+    case PCIEUNI_STREAM_START:
+      if(copy_from_user(&stream_config, (void*)arg, sizeof(pcieuni_stream_config))) {
+        retval = -EFAULT;
+        break;
+      }
+
+      retval = pcieuni_dma_stream_start(module_dev_pp, filp, &stream_config);
+      if(!retval && copy_to_user((void*)arg, &stream_config, sizeof(pcieuni_stream_config))) {
+        pcieuni_dma_stream_stop(module_dev_pp, filp);
+        retval = -EFAULT;
+      }
+      break;
+
+    case PCIEUNI_STREAM_STOP:
+      retval = pcieuni_dma_stream_stop(module_dev_pp, filp);
+      break;
+
+    case PCIEUNI_STREAM_NEXT:
+      retval = pcieuni_dma_stream_next(module_dev_pp, filp, &stream_slot);
+      if(!retval && copy_to_user((void*)arg, &stream_slot, sizeof(pcieuni_stream_slot))) {
+        pcieuni_dma_stream_release(module_dev_pp, filp);
+        retval = -EFAULT;
+      }
+      break;
+
+    case PCIEUNI_STREAM_RELEASE:
+      retval = pcieuni_dma_stream_release(module_dev_pp, filp);
+      break;
+
     default:
-      return -ENOTTY;
+      retval = -ENOTTY;
       break;
   }
-  mutex_unlock(&dev->dev_mut);
   return retval;
 }
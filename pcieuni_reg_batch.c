@@ -0,0 +1,177 @@
+/**
+ *  @file   pcieuni_reg_batch.c
+ *  @brief  Batched register access
+ *
+ *  A batch is a vector of register reads, writes and read-modify-writes which is executed in one ioctl() call under a
+ *  single acquisition of pcieuni_dev::dev_mut, so it is not interleaved with register access of other processes. The
+ *  whole batch is validated before the first register is touched. The registers of the DMA engine are not written by a
+ *  batch, they belong to the DMA transfers of the driver, which program them under module_dev::dmaLock.
+ */
+
+#include "pcieuni_fnc.h"
+#include <linux/io.h>
+#include <linux/mm.h>
+#include <linux/pci.h>
+#include <linux/uaccess.h>
+
+/**
+ * @brief Returns the size of a register access
+ *
+ * @param mode  Access width (RW_D8, RW_D16 or RW_D32)
+ *
+ * @return Size in bytes, 0 for an invalid mode
+ */
+static u32 pcieuni_reg_width(u8 mode) {
+  switch(mode) {
+    case RW_D8: return 1;
+    case RW_D16: return 2;
+    case RW_D32: return 4;
+    default: return 0;
+  }
+}
+
+/**
+ * @brief Returns the kernel address of a register
+ *
+ * @param dev   Target device
+ * @param op    Register operation
+ *
+ * @return Register address or NULL if the mode is invalid, the BAR is not mapped, the register is not inside the BAR
+ *         or a write hits the DMA engine registers
+ */
+static void __iomem* pcieuni_reg_address(pcieuni_dev* dev, pcieuni_reg_op* op) {
+  void __iomem* base = 0;
+  u32 width = pcieuni_reg_width(op->mode);
+
+  if(!width) return 0;
+
+  // DMA_BOARD_ADDRESS up to DMA_WR_CPU_ADDRESS_HI of the DMA BAR, written by a transfer started at any time
+  if(op->cmd != PCIEUNI_REG_READ && op->bar == 2 && op->offset < DMA_WR_CPU_ADDRESS_HI + 4 &&
+      (u64)op->offset + width > DMA_BOARD_ADDRESS) {
+    return 0;
+  }
+
+  switch(op->bar) {
+    case 0: base = dev->memmory_base0; break;
+    case 1: base = dev->memmory_base1; break;
+    case 2: base = dev->memmory_base2; break;
+    case 3: base = dev->memmory_base3; break;
+    case 4: base = dev->memmory_base4; break;
+    case 5: base = dev->memmory_base5; break;
+  }
+
+  if(!base || op->offset % width) return 0;
+  if((u64)op->offset + width > pci_resource_len(dev->pcieuni_pci_dev, op->bar)) return 0;
+  return base + op->offset;
+}
+
+/**
+ * @brief Reads a register
+ *
+ * @param addr  Register address
+ * @param mode  Access width (RW_D8, RW_D16 or RW_D32)
+ *
+ * @return Register value
+ */
+static u32 pcieuni_reg_read(void __iomem* addr, u8 mode) {
+  switch(mode) {
+    case RW_D8: return ioread8(addr);
+    case RW_D16: return ioread16(addr);
+    default: return ioread32(addr);
+  }
+}
+
+/**
+ * @brief Writes a register
+ *
+ * @param addr   Register address
+ * @param mode   Access width (RW_D8, RW_D16 or RW_D32)
+ * @param value  Value to write
+ */
+static void pcieuni_reg_write(void __iomem* addr, u8 mode, u32 value) {
+  switch(mode) {
+    case RW_D8: iowrite8(value, addr); break;
+    case RW_D16: iowrite16(value, addr); break;
+    default: iowrite32(value, addr); break;
+  }
+}
+
+/**
+ * @brief Executes a batch of register operations
+ *
+ * The operations are executed in order. Reads and read-modify-writes return the value read in pcieuni_reg_op::value
+ * of the user-space vector.
+ * @note This function may block.
+ *
+ * @param dev      Target device
+ * @param userOps  User-space vector of register operations
+ * @param count    Number of operations
+ *
+ * @retval 0             Success
+ * @retval -EINVAL       Too many operations or an operation is invalid, no register was accessed
+ * @retval -EFAULT       Failed to copy the operations from or to user space
+ * @retval -ENOMEM       Failed to allocate memory for the operations
+ * @retval -ERESTARTSYS  Interrupted while waiting for the device lock
+ */
+int pcieuni_reg_run_batch(pcieuni_dev* dev, pcieuni_reg_op __user* userOps, u32 count) {
+  int retVal = 0;
+  u32 i;
+  pcieuni_reg_op* ops;
+  void __iomem** addrs;
+  u32 value;
+
+  PDEBUG(dev->name, "pcieuni_reg_run_batch(count=%u)\n", count);
+
+  if(!count) return 0;
+  if(count > PCIEUNI_REG_BATCH_MAX) return -EINVAL;
+
+  ops = kvmalloc_array(count, sizeof(pcieuni_reg_op) + sizeof(void __iomem*), GFP_KERNEL);
+  if(!ops) return -ENOMEM;
+  addrs = (void __iomem**)(ops + count);
+
+  if(copy_from_user(ops, userOps, count * sizeof(pcieuni_reg_op))) {
+    retVal = -EFAULT;
+    goto cleanup;
+  }
+
+  for(i = 0; i < count; i++) {
+    addrs[i] = 0;
+    if(ops[i].cmd <= PCIEUNI_REG_RMW && !ops[i].reserved) {
+      addrs[i] = pcieuni_reg_address(dev, &ops[i]);
+    }
+    if(!addrs[i]) {
+      PDEBUG(dev->name, "pcieuni_reg_run_batch(): invalid operation %u\n", i);
+      retVal = -EINVAL;
+      goto cleanup;
+    }
+  }
+
+  if(mutex_lock_interruptible(&dev->dev_mut)) {
+    retVal = -ERESTARTSYS;
+    goto cleanup;
+  }
+
+  for(i = 0; i < count; i++) {
+    switch(ops[i].cmd) {
+      case PCIEUNI_REG_READ:
+        ops[i].value = pcieuni_reg_read(addrs[i], ops[i].mode);
+        break;
+      case PCIEUNI_REG_WRITE:
+        pcieuni_reg_write(addrs[i], ops[i].mode, ops[i].value);
+        break;
+      case PCIEUNI_REG_RMW:
+        value = pcieuni_reg_read(addrs[i], ops[i].mode);
+        pcieuni_reg_write(addrs[i], ops[i].mode, (value & ~ops[i].mask) | (ops[i].value & ops[i].mask));
+        ops[i].value = value;
+        break;
+    }
+  }
+
+  mutex_unlock(&dev->dev_mut);
+
+  if(copy_to_user(userOps, ops, count * sizeof(pcieuni_reg_op))) retVal = -EFAULT;
+
+cleanup:
+  kvfree(ops);
+  return retVal;
+}
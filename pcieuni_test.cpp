@@ -1,6 +1,8 @@
+#include "pcieuni_drv_io.h"
 #include <gpcieuni/pcieuni_io.h>
 #include <sys/file.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/time.h>
 #include <sys/types.h>
 
@@ -47,6 +49,20 @@ int main(int argc, char* argv[]) {
   int tmp_print = 0;
   int tmp_print_start = 0;
   int tmp_print_stop = 0;
+  pcieuni_write_dma DMA_WR;
+  pcieuni_ring_info RING_INFO;
+  pcieuni_ring_dma RING_DMA;
+  pcieuni_dma_async ASYNC_RD;
+  pcieuni_dma_result ASYNC_RES;
+  pcieuni_dma_sg_entry* SG_ENTRIES;
+  pcieuni_dma_sg SG_RD;
+  pcieuni_event_subscribe EVENT_SUB;
+  pcieuni_event EVENT;
+  pcieuni_stream_config STREAM_CFG;
+  pcieuni_stream_slot STREAM_SLOT;
+  void* ring_map;
+  u_int tmp_count;
+  u_int tmp_period;
 
   itemsize = sizeof(device_rw);
   printf("ITEMSIZE %i \n", itemsize);
@@ -68,6 +84,7 @@ int main(int argc, char* argv[]) {
     printf("\n GET DRIVER VERSION (2) or GET FIRMWARE VERSION (3) ?-");
     printf("\n GET SLOT NUM (4) or GET_DMA_TIME (5) or GET_INFO (6) ?-");
     printf("\n CTRL_DMA READ (30) CTRL_DMA WRITE (31) ?-");
+    printf("\n RING READ (32) ASYNC READ (33) SG READ (34) EVENTS (35) STREAM (36) ?-");
     printf("\n END (11) ?-");
     scanf("%d", &ch_in);
     fflush(stdin);
@@ -239,6 +256,187 @@ int main(int argc, char* argv[]) {
         }
         if(tmp_dma_buf) delete tmp_dma_buf;
         break;
+      case 31:
+        printf("\n INPUT  DMA_SIZE (num of sumples (int))  -");
+        scanf("%d", &tmp_size);
+        fflush(stdin);
+        printf("\n INPUT OFFSET (int)  -");
+        scanf("%d", &tmp_offset);
+        fflush(stdin);
+        printf("\n INPUT START DATA (IN HEX), samples are incremented by 1  -");
+        scanf("%x", &tmp_data);
+        fflush(stdin);
+
+        tmp_dma_buf = new int[tmp_size];
+        for(u_int i = 0; i < tmp_size; i++) {
+          tmp_dma_buf[i] = tmp_data + i;
+        }
+        DMA_WR.data = (uintptr_t)tmp_dma_buf;
+        DMA_WR.dma_offset = tmp_offset;
+        DMA_WR.dma_size = sizeof(int) * tmp_size;
+        printf("DMA_OFFSET - %X, DMA_SIZE - %X\n", DMA_WR.dma_offset, DMA_WR.dma_size);
+
+        gettimeofday(&start_time, 0);
+        code = ioctl(fd, PCIEUNI_DMA_WRITE, &DMA_WR);
+        gettimeofday(&end_time, 0);
+        printf("===========WRITTEN  CODE %i\n", code);
+        time_tmp = MIKRS(end_time) - MIKRS(start_time);
+        time_dlt = MILLS(end_time) - MILLS(start_time);
+        printf("STOP WRITING TIME %fms : %fmks  SIZE %lu\n", time_dlt, time_tmp, (sizeof(int) * tmp_size));
+        printf("STOP WRITING KBytes/Sec %f\n", ((sizeof(int) * tmp_size * 1000) / time_tmp));
+        delete[] tmp_dma_buf;
+        break;
+      case 32:
+        code = ioctl(fd, PCIEUNI_RING_INFO, &RING_INFO);
+        if(code) {
+          printf("######ERROR RING INFO %d\n", code);
+          break;
+        }
+        printf("RING SLOTS %u SLOT_SIZE %X\n", RING_INFO.slot_count, RING_INFO.slot_size);
+        ring_map = mmap(0, (size_t)RING_INFO.slot_count * RING_INFO.slot_size, PROT_READ, MAP_SHARED, fd, 0);
+        if(ring_map == MAP_FAILED) {
+          printf("######ERROR RING MMAP\n");
+          break;
+        }
+        printf("\n INPUT  DMA_SIZE (num of sumples (int))  -");
+        scanf("%d", &tmp_size);
+        fflush(stdin);
+        printf("\n INPUT OFFSET (int)  -");
+        scanf("%d", &tmp_offset);
+        fflush(stdin);
+
+        memset(&RING_DMA, 0, sizeof(RING_DMA));
+        RING_DMA.dma_offset = tmp_offset;
+        RING_DMA.dma_size = sizeof(int) * tmp_size;
+        gettimeofday(&start_time, 0);
+        code = ioctl(fd, PCIEUNI_RING_READ_DMA, &RING_DMA);
+        gettimeofday(&end_time, 0);
+        printf("===========READED  CODE %i SLOT %u\n", code, RING_DMA.slot);
+        time_tmp = MIKRS(end_time) - MIKRS(start_time);
+        printf("STOP READING TIME %fmks  SIZE %lu\n", time_tmp, (sizeof(int) * tmp_size));
+        if(!code) {
+          tmp_dma_buf = (int*)((char*)ring_map + RING_DMA.slot_offset);
+          for(u_int i = 0; i < tmp_size && i < 16; i++) {
+            printf("NUM %i OFFSET %X : DATA %X\n", i, (u_int)(i * sizeof(int)), (u_int)(tmp_dma_buf[i] & 0xFFFFFFFF));
+          }
+          code = ioctl(fd, PCIEUNI_RING_RELEASE, &RING_DMA.slot);
+          printf("===========RELEASED CODE %i\n", code);
+        }
+        munmap(ring_map, (size_t)RING_INFO.slot_count * RING_INFO.slot_size);
+        break;
+      case 33:
+        printf("\n INPUT  DMA_SIZE (num of sumples (int))  -");
+        scanf("%d", &tmp_size);
+        fflush(stdin);
+        printf("\n INPUT OFFSET (int)  -");
+        scanf("%d", &tmp_offset);
+        fflush(stdin);
+
+        memset(&ASYNC_RD, 0, sizeof(ASYNC_RD));
+        ASYNC_RD.dma_offset = tmp_offset;
+        ASYNC_RD.dma_size = sizeof(int) * tmp_size;
+        code = ioctl(fd, PCIEUNI_DMA_SUBMIT, &ASYNC_RD);
+        printf("===========SUBMITTED CODE %i ID %u\n", code, ASYNC_RD.id);
+        if(code) break;
+
+        tmp_dma_buf = new int[tmp_size];
+        memset(&ASYNC_RES, 0, sizeof(ASYNC_RES));
+        ASYNC_RES.data = (uintptr_t)tmp_dma_buf;
+        // the request is collected as soon as it is finished
+        for(k = 0; k < 1000; k++) {
+          code = ioctl(fd, PCIEUNI_DMA_COLLECT, &ASYNC_RES);
+          if(!code) break;
+          usleep(1000);
+        }
+        printf("===========COLLECTED CODE %i ID %u STATUS %i SIZE %X\n", code, ASYNC_RES.id, ASYNC_RES.status,
+            ASYNC_RES.dma_size);
+        delete[] tmp_dma_buf;
+        break;
+      case 34:
+        printf("\n INPUT  NUMBER OF REGIONS  -");
+        scanf("%d", &tmp_count);
+        fflush(stdin);
+        printf("\n INPUT  DMA_SIZE OF A REGION (num of sumples (int))  -");
+        scanf("%d", &tmp_size);
+        fflush(stdin);
+        printf("\n INPUT OFFSET OF THE FIRST REGION (int), the regions follow each other  -");
+        scanf("%d", &tmp_offset);
+        fflush(stdin);
+
+        tmp_dma_buf = new int[tmp_count * tmp_size];
+        SG_ENTRIES = new pcieuni_dma_sg_entry[tmp_count];
+        for(u_int i = 0; i < tmp_count; i++) {
+          SG_ENTRIES[i].data = (uintptr_t)(tmp_dma_buf + i * tmp_size);
+          SG_ENTRIES[i].dma_offset = tmp_offset + i * sizeof(int) * tmp_size;
+          SG_ENTRIES[i].dma_size = sizeof(int) * tmp_size;
+        }
+        memset(&SG_RD, 0, sizeof(SG_RD));
+        SG_RD.entries = (uintptr_t)SG_ENTRIES;
+        SG_RD.count = tmp_count;
+
+        gettimeofday(&start_time, 0);
+        code = ioctl(fd, PCIEUNI_READ_DMA_SG, &SG_RD);
+        gettimeofday(&end_time, 0);
+        printf("===========READED  CODE %i\n", code);
+        time_tmp = MIKRS(end_time) - MIKRS(start_time);
+        printf("STOP READING TIME %fmks  SIZE %lu\n", time_tmp, (sizeof(int) * tmp_size * tmp_count));
+        delete[] SG_ENTRIES;
+        delete[] tmp_dma_buf;
+        break;
+      case 35:
+        memset(&EVENT_SUB, 0, sizeof(EVENT_SUB));
+        EVENT_SUB.eventfd = -1;
+        code = ioctl(fd, PCIEUNI_EVENT_SUBSCRIBE, &EVENT_SUB);
+        printf("===========SUBSCRIBED CODE %i\n", code);
+        if(code) break;
+        printf("\n INPUT TIME TO COLLECT EVENTS (ms)  -");
+        scanf("%d", &tmp_period);
+        fflush(stdin);
+        usleep(tmp_period * 1000);
+
+        code = ioctl(fd, PCIEUNI_EVENT_READ, &EVENT);
+        printf("===========READED  CODE %i\n", code);
+        printf("EVENTS %llu PENDING %llu LAST %llu ns\n", (unsigned long long)EVENT.count,
+            (unsigned long long)EVENT.pending, (unsigned long long)EVENT.timestamp_ns);
+        code = ioctl(fd, PCIEUNI_EVENT_UNSUBSCRIBE, 0);
+        printf("===========UNSUBSCRIBED CODE %i\n", code);
+        break;
+      case 36:
+        printf("\n INPUT  DMA_SIZE (num of sumples (int))  -");
+        scanf("%d", &tmp_size);
+        fflush(stdin);
+        printf("\n INPUT OFFSET (int)  -");
+        scanf("%d", &tmp_offset);
+        fflush(stdin);
+        printf("\n INPUT PERIOD (us, 0 - back to back)  -");
+        scanf("%d", &tmp_period);
+        fflush(stdin);
+        printf("\n INPUT NUMBER OF READS  -");
+        scanf("%d", &tmp_count);
+        fflush(stdin);
+
+        memset(&STREAM_CFG, 0, sizeof(STREAM_CFG));
+        STREAM_CFG.dma_offset = tmp_offset;
+        STREAM_CFG.dma_size = sizeof(int) * tmp_size;
+        STREAM_CFG.period_us = tmp_period;
+        code = ioctl(fd, PCIEUNI_STREAM_START, &STREAM_CFG);
+        printf("===========STARTED CODE %i SLOTS %u\n", code, STREAM_CFG.slots);
+        if(code) break;
+
+        for(u_int i = 0; i < tmp_count; i++) {
+          code = ioctl(fd, PCIEUNI_STREAM_NEXT, &STREAM_SLOT);
+          if(code) {
+            printf("######ERROR STREAM NEXT %d\n", code);
+            break;
+          }
+          printf("SEQ %llu SLOT %u SIZE %X TIME %llu ns OVERRUNS %llu\n", (unsigned long long)STREAM_SLOT.seq,
+              STREAM_SLOT.slot, STREAM_SLOT.dma_size, (unsigned long long)STREAM_SLOT.timestamp_ns,
+              (unsigned long long)STREAM_SLOT.overruns);
+          ioctl(fd, PCIEUNI_STREAM_RELEASE, 0);
+        }
+        code = ioctl(fd, PCIEUNI_STREAM_STOP, 0);
+        printf("===========STOPPED CODE %i\n", code);
+        break;
       default:
         break;
     }
@@ -0,0 +1,64 @@
+/**
+ *  @file   pcieuni_trace.h
+ *  @brief  Tracepoints of the DMA path
+ *
+ *  The events are in the trace system "pcieuni" and can be enabled with ftrace, perf or bpftrace, e.g.
+ *  echo 1 > /sys/kernel/tracing/events/pcieuni/enable. All events carry the board number, the target buffer and the
+ *  offset and size of the transfer.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM pcieuni
+
+#if !defined(_PCIEUNI_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define _PCIEUNI_TRACE_H_
+
+#include <linux/tracepoint.h>
+
+DECLARE_EVENT_CLASS(pcieuni_dma_class,
+    TP_PROTO(int brd, const void* buffer, unsigned long offset, unsigned long size),
+    TP_ARGS(brd, buffer, offset, size),
+    TP_STRUCT__entry(__field(int, brd) __field(const void*, buffer) __field(unsigned long, offset)
+            __field(unsigned long, size)),
+    TP_fast_assign(__entry->brd = brd; __entry->buffer = buffer; __entry->offset = offset; __entry->size = size;),
+    TP_printk("brd=%d buffer=%p offset=0x%lx size=0x%lx", __entry->brd, __entry->buffer, __entry->offset,
+        __entry->size));
+
+/* Transfer queued because the DMA engine is busy */
+DEFINE_EVENT(pcieuni_dma_class, pcieuni_dma_queue,
+    TP_PROTO(int brd, const void* buffer, unsigned long offset, unsigned long size),
+    TP_ARGS(brd, buffer, offset, size));
+
+/* DMA engine registers programmed */
+DEFINE_EVENT(pcieuni_dma_class, pcieuni_dma_start,
+    TP_PROTO(int brd, const void* buffer, unsigned long offset, unsigned long size),
+    TP_ARGS(brd, buffer, offset, size));
+
+/* End of DMA interrupt */
+DEFINE_EVENT(pcieuni_dma_class, pcieuni_dma_irq,
+    TP_PROTO(int brd, const void* buffer, unsigned long offset, unsigned long size),
+    TP_ARGS(brd, buffer, offset, size));
+
+/* DMA engine released, the next queued transfer is started right after */
+DEFINE_EVENT(pcieuni_dma_class, pcieuni_dma_release,
+    TP_PROTO(int brd, const void* buffer, unsigned long offset, unsigned long size),
+    TP_ARGS(brd, buffer, offset, size));
+
+/* Waiting process running again after the transfer finished */
+DEFINE_EVENT(pcieuni_dma_class, pcieuni_dma_wakeup,
+    TP_PROTO(int brd, const void* buffer, unsigned long offset, unsigned long size),
+    TP_ARGS(brd, buffer, offset, size));
+
+/* Transfer data copied to user space */
+DEFINE_EVENT(pcieuni_dma_class, pcieuni_dma_copy,
+    TP_PROTO(int brd, const void* buffer, unsigned long offset, unsigned long size),
+    TP_ARGS(brd, buffer, offset, size));
+
+#endif /* _PCIEUNI_TRACE_H_ */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE pcieuni_trace
+#include <trace/define_trace.h>